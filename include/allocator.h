@@ -0,0 +1,79 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct db_allocator {
+    void* (*malloc)(size_t size, void* ctx);
+    void* (*realloc)(void* ptr, size_t size, void* ctx);
+    void (*free)(void* ptr, void* ctx);
+    void* ctx;
+} db_allocator;
+
+// What a wrapper block is used for, see db_tag.
+typedef enum db_mem_tag {
+    MEM_OTHER = 0,
+    MEM_CONTENT,    /* db_content entries, keys, values and column sets */
+    MEM_CURSOR,     /* Cursors and their buffers */
+    MEM_STRING,     /* SQL text built by the query builder */
+    MEM_CACHE,      /* Cached statements, plans and rules */
+    MEM_TAG_COUNT
+} db_mem_tag;
+
+typedef struct db_alloc_stats {
+    int64_t allocations;        /* Blocks handed out by the wrapper */
+    int64_t frees;              /* Blocks returned by the wrapper */
+    int64_t live_bytes;         /* Bytes currently held by the wrapper */
+    int64_t peak_bytes;         /* High-water mark of live_bytes, to
+                                   within 64 KiB per thread */
+    int64_t pool_hits;          /* Pool allocations served from a free list */
+    int64_t pool_misses;        /* Pool allocations that fell back to malloc */
+    int64_t pool_free_bytes;    /* Bytes parked in the free lists */
+    int64_t sqlite_allocations; /* Blocks handed out to SQLite */
+    int64_t sqlite_live_bytes;  /* Bytes currently held by SQLite */
+    int64_t tag_bytes[MEM_TAG_COUNT];  /* live_bytes broken down by tag */
+} db_alloc_stats;
+
+// Replace the allocator used by the wrapper. Call it before any other
+// wrapper function; NULL restores malloc/realloc/free.
+void db_set_allocator(const db_allocator* allocator);
+
+// Route SQLite's own allocations through the wrapper allocator. Must be
+// called before the first connection is opened.
+int db_use_allocator_for_sqlite();
+// Give SQLite a static page cache buffer of `pages` slots of `page_size`
+// bytes (plus per-page overhead). Must be called before the first open.
+int db_config_page_cache(void* buffer, int page_size, int pages);
+// Configure the per-connection lookaside allocator for small objects.
+int db_config_lookaside(sqlite3* db, int slot_size, int slots);
+
+void* db_malloc(size_t size);
+void* db_calloc(size_t count, size_t size);
+void* db_realloc(void* ptr, size_t size);
+void db_free(void* ptr);
+char* db_strdup(const char* s);
+// Account a live block to `tag`; blocks start as MEM_OTHER. Returns `ptr`
+// so it can wrap the allocation: db_tag(db_malloc(n), MEM_CACHE).
+void* db_tag(void* ptr, db_mem_tag tag);
+
+// Per-thread free lists for small fixed-size objects. A block must be
+// released with db_pool_free, from any thread.
+void* db_pool_alloc(size_t size);
+void db_pool_free(void* ptr);
+// Return the free lists of the calling thread to the allocator.
+void db_pool_trim();
+
+void db_alloc_get_stats(db_alloc_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // ALLOCATOR_H
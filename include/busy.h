@@ -0,0 +1,48 @@
+#ifndef BUSY_H
+#define BUSY_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DB_BUSY_HISTOGRAM_BUCKETS 16
+
+// Zero fields take the default.
+typedef struct db_busy_policy {
+    int initial_backoff_us;  /* First sleep of a busy wait, default 100 */
+    int max_backoff_us;      /* Cap of the exponential backoff, default 50000 */
+    int deadline_ms;         /* Give up a busy wait after, default 5000 */
+    int max_retries;         /* Statement retries after SQLITE_BUSY or
+                                SQLITE_LOCKED, default 3, negative for none */
+} db_busy_policy;
+
+typedef struct db_busy_stats {
+    int64_t busy_waits;         /* Busy handler invocations */
+    int64_t timeouts;           /* Busy waits that hit the deadline */
+    int64_t retries;            /* Statement-level retries */
+    int64_t failures;           /* Statements that failed after retrying */
+    /* Wall time of statements that met contention. Bucket 0 counts waits
+       under 1 ms, bucket i waits in [2^(i-1), 2^i) ms, the last bucket
+       everything longer. */
+    int64_t wait_ms_histogram[DB_BUSY_HISTOGRAM_BUCKETS];
+    /* Retries per contended statement, bucket i counts i retries. */
+    int64_t retry_histogram[DB_BUSY_HISTOGRAM_BUCKETS];
+} db_busy_stats;
+
+// Install the contention policy on `db`; NULL installs the defaults, which
+// db_init already does. A busy handler sleeps with jittered exponential
+// backoff until the deadline, then statements run by the wrapper are retried
+// up to max_retries times, unless inside a transaction or already returning
+// rows.
+int db_set_busy_policy(sqlite3* db, const db_busy_policy* policy);
+bool db_busy_get_stats(sqlite3* db, db_busy_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // BUSY_H
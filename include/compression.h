@@ -0,0 +1,39 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct db_compress_stats {
+    int64_t compressed;         /* Values stored compressed */
+    int64_t skipped;            /* Values that did not shrink, stored as is */
+    int64_t input_bytes;        /* Size of the compressed values before */
+    int64_t output_bytes;       /* and after compression, header included */
+    int64_t decompressed;       /* Values expanded by a cursor */
+} db_compress_stats;
+
+// Compress TEXT and BLOB values of `table`.`column` written by db_insert
+// and db_update once they are at least `threshold` bytes, 0 for the default
+// of 256. A NULL column applies to every column of the table without a rule
+// of its own.
+//
+// Compressed values are stored as BLOBs with a small header and expanded
+// transparently by cursor_get_text, cursor_get_blob and cursor_read_struct.
+// SQL itself sees the BLOB, so do not compress columns that are filtered,
+// sorted or indexed on.
+int db_compress_column(sqlite3* db, const char* table, const char* column,
+                       size_t threshold);
+
+// Process-wide counters.
+void db_compress_get_stats(db_compress_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // COMPRESSION_H
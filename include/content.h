@@ -27,12 +27,17 @@ void content_insert_text(db_content* data, const char* key, const char* s);
 
 void content_insert_int(db_content* data, const char* key, int i);
 void content_insert_double(db_content* data, const char* key, double d);
+// The bytes are copied.
+void content_insert_blob(db_content* data, const char* key, const void* blob,
+                         size_t len);
 
 void content_erase(db_content* data, const char* key);
 
 const char* content_get_text(db_value value);
 int content_get_int(db_value value);
 double content_get_double(db_value data);
+const void* content_get_blob(db_value value);
+size_t content_get_bytes(db_value value);
 
 db_value content_get_value(db_content data, const char* key);
 value_type content_get_type(db_value value);
@@ -13,10 +13,17 @@ typedef struct cursor_t* db_cursor;
 
 // Create a cursor
 db_cursor cursor_new(sqlite3* db, sqlite3_stmt* stmt);
+// Create a cursor that does not finalize `stmt` when deleted
+db_cursor cursor_new_borrowed(sqlite3* db, sqlite3_stmt* stmt);
 db_cursor cursor_next(db_cursor cursor);
+// Result of the last step: SQLITE_ROW, SQLITE_DONE or the error that made
+// cursor_next return NULL, e.g. DB_DEADLINE_EXCEEDED or DB_CANCELLED.
+int cursor_status(db_cursor cursor);
 int cursor_get_int(db_cursor cursor, int col);
 const char* cursor_get_text(db_cursor cursor, int col);
 double cursor_get_double(db_cursor cursor, int col);
+const void* cursor_get_blob(db_cursor cursor, int col);
+int cursor_get_bytes(db_cursor cursor, int col);
 int cursor_column_count(db_cursor cursor);
 const char* cursor_get_column_name(db_cursor cursor, int col);
 value_type cursor_get_column_type(db_cursor cursor, int col);
@@ -0,0 +1,35 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <sqlite3.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Extended codes of SQLITE_INTERRUPT, so (rc & 0xff) == SQLITE_INTERRUPT
+// still holds for callers that only check the primary code.
+#define DB_DEADLINE_EXCEEDED (SQLITE_INTERRUPT | (64 << 8))
+#define DB_CANCELLED (SQLITE_INTERRUPT | (65 << 8))
+
+// Time budget of every statement run on `db`, counted from its first step.
+// A query keeps its budget across cursor_next calls. 0 disables it.
+int db_set_timeout(sqlite3* db, int timeout_ms);
+// Budget of the next statement started on `db` only, overriding the
+// connection timeout once.
+int db_set_call_timeout(sqlite3* db, int timeout_ms);
+
+// Abort the statements running on `db`, they fail with DB_CANCELLED.
+// Safe to call from any thread while the handle is open.
+int db_cancel(sqlite3* db);
+
+// Result of the last step run on `db` by the wrapper: SQLITE_ROW,
+// SQLITE_DONE, SQLITE_OK, an error code, DB_DEADLINE_EXCEEDED or
+// DB_CANCELLED. Tells why db_query returned NULL.
+int db_last_status(sqlite3* db);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // DEADLINE_H
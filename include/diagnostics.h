@@ -0,0 +1,37 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum plan_flag {
+    PLAN_FULL_SCAN = 1 << 0,   /* A table is scanned without an index */
+    PLAN_TEMP_BTREE = 1 << 1,  /* ORDER BY/GROUP BY/DISTINCT needs a sort */
+    PLAN_AUTO_INDEX = 1 << 2   /* SQLite builds a throwaway index per run */
+} plan_flag;
+
+// Opt-in per connection. While enabled, every statement run through
+// db_query, db_query_sql, db_insert, db_update and db_stmt is recorded:
+// its plan is explained once and its sqlite3_stmt_status counters are
+// accumulated each time it is reset or finalized. The 256 most recently
+// run statements are kept, db_release_memory drops them all.
+void db_diagnostics_enable(sqlite3* db, bool enable);
+void db_diagnostics_reset(sqlite3* db);
+
+// Plan flags recorded for `sql`, or -1 if it was never seen.
+int db_diagnostics_plan_flags(sqlite3* db, const char* sql);
+
+// Print the `max` statements with the most full-scan and VM steps, with
+// their plan, counters and a suggested covering index when one applies.
+void db_diagnostics_report(sqlite3* db, FILE* out, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // DIAGNOSTICS_H
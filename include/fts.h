@@ -0,0 +1,38 @@
+#ifndef FTS_H
+#define FTS_H
+
+#include <sqlite3.h>
+
+#include "content.h"
+#include "cursor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Index `columns` of `table` in the FTS5 table `<table>_fts`. The index
+// keeps no copy of the text, it reads it back from `table` by rowid, and
+// triggers keep it in sync with every insert, update and delete. Existing
+// rows are indexed. Does nothing when the index already exists. `table`
+// needs a rowid and the columns must not have a compression rule.
+int db_fts_create(sqlite3* db, const char* table, db_column columns);
+// Drop the index and its triggers.
+int db_fts_drop(sqlite3* db, const char* table);
+// Rebuild the index from `table`, e.g. after loading rows with the
+// triggers dropped or after changing the tokenizer.
+int db_fts_rebuild(sqlite3* db, const char* table);
+// Merge the index segments into one. Worth it after large loads.
+int db_fts_optimize(sqlite3* db, const char* table);
+
+// Rows of `table` matching the FTS5 query `match_expr`, best first by
+// bm25. `columns` NULL selects every column, `limit` <= 0 returns all
+// matches. Like db_query, the cursor is on the first row, or NULL when
+// nothing matched.
+db_cursor db_search(sqlite3* db, const char* table, const char* match_expr,
+                    db_column columns, int limit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // FTS_H
@@ -0,0 +1,80 @@
+#ifndef FUNCTION_H
+#define FUNCTION_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "content.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum func_flag {
+    FUNC_DETERMINISTIC = 1 << 0,  /* Same arguments always give same result */
+    FUNC_INNOCUOUS = 1 << 1,      /* No side effects, safe in schema/triggers */
+    FUNC_DIRECTONLY = 1 << 2      /* Only callable from top-level SQL */
+} func_flag;
+
+typedef struct func_call_t* db_func_call;
+
+// Called for scalar evaluation, aggregate step/final and window value/inverse.
+typedef void (*db_func_callback)(db_func_call call);
+
+typedef struct db_func_stats {
+    int64_t calls;     /* Number of callback invocations */
+    int64_t total_us;  /* Time spent in callbacks */
+    int64_t max_us;    /* Slowest single invocation */
+} db_func_stats;
+
+// Register functions on a connection. `nargs` is -1 for variadic functions,
+// `flags` is a mask of func_flag. Aggregate and window functions get a zeroed
+// per-group state of `state_size` bytes through func_state.
+int db_create_scalar_function(sqlite3* db, const char* name, int nargs,
+                              int flags, db_func_callback func,
+                              void* user_data);
+int db_create_aggregate_function(sqlite3* db, const char* name, int nargs,
+                                 int flags, size_t state_size,
+                                 db_func_callback step,
+                                 db_func_callback final,
+                                 void* user_data);
+int db_create_window_function(sqlite3* db, const char* name, int nargs,
+                              int flags, size_t state_size,
+                              db_func_callback step, db_func_callback final,
+                              db_func_callback value,
+                              db_func_callback inverse, void* user_data);
+int db_drop_function(sqlite3* db, const char* name, int nargs);
+
+// Stats are summed over every registered arity of `name`.
+bool db_function_stats(sqlite3* db, const char* name, db_func_stats* stats);
+void db_function_reset_stats(sqlite3* db);
+
+// Argument access
+int func_arg_count(db_func_call call);
+value_type func_arg_type(db_func_call call, int i);
+int func_arg_int(db_func_call call, int i);
+int64_t func_arg_int64(db_func_call call, int i);
+double func_arg_double(db_func_call call, int i);
+const char* func_arg_text(db_func_call call, int i);
+const void* func_arg_blob(db_func_call call, int i);
+int func_arg_bytes(db_func_call call, int i);
+
+void* func_user_data(db_func_call call);
+// Aggregate/window state, NULL for scalar functions.
+void* func_state(db_func_call call);
+
+// Results
+void func_result_null(db_func_call call);
+void func_result_int(db_func_call call, int i);
+void func_result_int64(db_func_call call, int64_t i);
+void func_result_double(db_func_call call, double d);
+void func_result_text(db_func_call call, const char* s, int len);
+void func_result_blob(db_func_call call, const void* data, int len);
+void func_result_error(db_func_call call, const char* msg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // FUNCTION_H
@@ -0,0 +1,58 @@
+#ifndef KV_H
+#define KV_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kv_t* db_kv;
+
+typedef struct db_kv_pair {
+    const char* key;
+    const void* value;           /* NULL stores SQL NULL */
+    size_t len;
+} db_kv_pair;
+
+// Called for each row read. `value` points into the row and is only valid
+// during the call. Return false to stop. The store is locked meanwhile, do
+// not call back into it.
+typedef bool (*kv_callback)(const char* key, const void* value, size_t len,
+                            void* arg);
+
+// Open the key-value table `name`, creating it as a WITHOUT ROWID table
+// keyed by TEXT. Its statements stay prepared until kv_close, which must
+// be called before db_deinit. Returns NULL on error. The store may be
+// shared between threads: writes, batches and kv_multi_get wait for a
+// scope another thread has open on the connection. kv_get does not wait,
+// it sees the rows an open write scope wrote so far.
+db_kv kv_open(sqlite3* db, const char* name);
+void kv_close(db_kv kv);
+
+// Insert or replace the value of `key`.
+int kv_put(db_kv kv, const char* key, const void* value, size_t len);
+// Store `count` pairs in one write scope, a savepoint inside the caller's
+// scope or transaction.
+int kv_put_batch(db_kv kv, const db_kv_pair* pairs, size_t count);
+// Copy the value of `key` into `buf` and set `len` to its size. Returns
+// SQLITE_NOTFOUND for a missing key, SQLITE_TOOBIG when `cap` is too small,
+// `len` then holds the size needed.
+int kv_get(db_kv kv, const char* key, void* buf, size_t cap, size_t* len);
+int kv_delete(db_kv kv, const char* key);
+
+// Look `count` keys up against one read snapshot. `callback` gets every key
+// in order, with a NULL value when it is missing.
+int kv_multi_get(db_kv kv, const char* const* keys, size_t count,
+                 kv_callback callback, void* arg);
+// Visit the keys starting with `prefix` in key order, "" visits them all.
+int kv_scan_prefix(db_kv kv, const char* prefix, kv_callback callback,
+                   void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // KV_H
@@ -0,0 +1,56 @@
+#ifndef MAINTENANCE_H
+#define MAINTENANCE_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Zero fields take the default, negative intervals disable the job.
+typedef struct db_maintenance_options {
+    int checkpoint_interval_ms;  /* PASSIVE checkpoint period, default 1000 */
+    int64_t wal_size_limit;      /* WAL bytes that escalate the checkpoint to
+                                    RESTART, then TRUNCATE if the file stays
+                                    larger, default 64 MiB */
+    int optimize_interval_ms;    /* PRAGMA optimize period, default 1 hour */
+    int vacuum_interval_ms;      /* incremental_vacuum period, default 60000 */
+    int vacuum_pages;            /* Pages freed per vacuum chunk, default 256 */
+    int idle_ms;                 /* Time without commits before vacuuming,
+                                    default 1000 */
+} db_maintenance_options;
+
+typedef struct db_job_stats {
+    int64_t runs;
+    int64_t failures;
+    int64_t last_ms;             /* Wall time of the last run */
+    int64_t max_ms;
+    int64_t total_ms;
+} db_job_stats;
+
+typedef struct db_maintenance_stats {
+    db_job_stats checkpoint;
+    db_job_stats optimize;
+    db_job_stats vacuum;
+    int64_t escalations;         /* RESTART or TRUNCATE checkpoints */
+    int64_t wal_frames;          /* WAL size after the last checkpoint */
+    int64_t vacuumed_pages;
+} db_maintenance_stats;
+
+// Run checkpoints, PRAGMA optimize and incremental vacuum for the database
+// file of `db` on a thread with its own connection. The database is put in
+// WAL mode and `db` no longer checkpoints on commit, so writers never pay
+// for maintenance. Incremental vacuum only runs with auto_vacuum set to
+// INCREMENTAL. `options` may be NULL for the defaults.
+int db_start_maintenance(sqlite3* db, const db_maintenance_options* options);
+// Stop the thread and give checkpoints back to `db`. db_deinit calls it.
+void db_stop_maintenance(sqlite3* db);
+bool db_maintenance_get_stats(sqlite3* db, db_maintenance_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // MAINTENANCE_H
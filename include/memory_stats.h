@@ -0,0 +1,53 @@
+#ifndef MEMORY_STATS_H
+#define MEMORY_STATS_H
+
+#include <sqlite3.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct db_mem_stats {
+    /* SQLite, whole process (sqlite3_status64) */
+    int64_t sqlite_memory_used;     /* Bytes held by SQLite's allocator */
+    int64_t sqlite_memory_peak;
+    int64_t pagecache_used;         /* Slots used in db_config_page_cache */
+    int64_t pagecache_overflow;     /* Page bytes that did not fit there */
+
+    /* SQLite, this connection (sqlite3_db_status) */
+    int64_t cache_used;             /* Page cache bytes */
+    int64_t cache_hit;
+    int64_t cache_miss;
+    int64_t cache_write;
+    int64_t lookaside_used;         /* Slots in use */
+    int64_t lookaside_hit;
+    int64_t lookaside_miss_size;    /* Requests too big for a slot */
+    int64_t lookaside_miss_full;    /* Requests with every slot taken */
+    int64_t schema_used;            /* Bytes of parsed schema */
+    int64_t stmt_used;              /* Bytes of prepared statements */
+
+    /* Wrapper, whole process */
+    int64_t wrapper_live_bytes;
+    int64_t content_bytes;          /* db_content and column sets */
+    int64_t cursor_bytes;           /* Cursors and their buffers */
+    int64_t string_bytes;           /* SQL being built */
+    int64_t cache_bytes;            /* Cached statements, plans and rules */
+    int64_t pool_free_bytes;        /* Parked in the per-thread free lists */
+} db_mem_stats;
+
+// Snapshot the memory used by SQLite and the wrapper. The counters of
+// SQLite are read without resetting them.
+int db_memory_stats(sqlite3* db, db_mem_stats* stats);
+
+// Shed what can be rebuilt: unused pages of the page cache of `db`, its
+// cached struct inserts and the free lists of the calling thread. A NULL
+// `db` asks SQLite to release memory process-wide. Returns the number of
+// bytes released.
+int64_t db_release_memory(sqlite3* db);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // MEMORY_STATS_H
@@ -0,0 +1,45 @@
+#ifndef PAGER_H
+#define PAGER_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+
+#include "content.h"
+#include "cursor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pager_t* db_pager;
+
+// Called for each row of a page, with the cursor on the row. Return false
+// to stop, the token then continues after this row.
+typedef bool (*db_page_callback)(db_cursor cursor, void* arg);
+
+// Page through `table` in ascending order of `keys`, `page_size` rows at a
+// time. The keys must identify a row, end them with the primary key if
+// needed, be NOT NULL and should be covered by an index. `columns` NULL selects every
+// column. The key columns are appended after `columns` in each row.
+// `where` is an optional fixed filter. Returns NULL if the SQL does not
+// compile.
+db_pager db_pager_new(sqlite3* db, const char* table, db_column columns,
+                      db_column keys, const char* where, int page_size);
+void db_pager_delete(db_pager pager);
+
+// Read the page after `token`, NULL or "" for the first page. Seeks with
+// WHERE (k1, k2, ...) > (...) instead of OFFSET, so every page costs the
+// same whatever its depth. Returns SQLITE_MISMATCH when a row has a NULL
+// key, before it is passed to `callback`.
+int db_pager_fetch(db_pager pager, const char* token,
+                   db_page_callback callback, void* arg);
+// Opaque token of the page after the last one fetched, NULL when it was
+// the last page. Valid until the next fetch, it may be passed straight
+// back to db_pager_fetch.
+const char* db_pager_next_token(db_pager pager);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // PAGER_H
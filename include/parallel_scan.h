@@ -0,0 +1,34 @@
+#ifndef PARALLEL_SCAN_H
+#define PARALLEL_SCAN_H
+
+#include "content.h"
+#include "cursor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Called on a worker thread for every row of the rowid range it owns.
+// `part` is the range index in [0, nthreads). Return non-zero to stop
+// scanning that range.
+typedef int (*db_scan_row_callback)(db_cursor cursor, int part, void* ctx);
+
+// Called on the calling thread once per range, in range order, after every
+// worker has finished. Use it to merge per-range partial results. Not called
+// when any range failed.
+typedef void (*db_scan_reduce_callback)(int part, void* ctx);
+
+// Split `table` into `nthreads` rowid ranges and scan each one on its own
+// read-only connection. The database is switched to WAL mode so the workers
+// do not block each other or concurrent writers. `reduce` may be NULL.
+// Returns the error of the first range that failed.
+int db_parallel_scan(const char* db_path, const char* table,
+                     db_column columns, const char* where, int nthreads,
+                     db_scan_row_callback row_callback,
+                     db_scan_reduce_callback reduce, void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // PARALLEL_SCAN_H
@@ -0,0 +1,61 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <sqlite3.h>
+#include <stdint.h>
+
+#include "content.h"
+#include "cursor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum db_partition_unit {
+    PARTITION_DAY = 1,         /* <table>_pYYYYMMDD, UTC */
+    PARTITION_HOUR             /* <table>_pYYYYMMDDHH, UTC */
+} db_partition_unit;
+
+typedef struct db_partition_options {
+    const char* ts_column;     /* Routing column, unix seconds */
+    db_partition_unit unit;
+    const char* columns_sql;   /* Column definitions of a partition, e.g.
+                                  "ts INTEGER NOT NULL, kind TEXT" */
+    const char* dir;           /* NULL keeps partitions as tables of the
+                                  main database, else each one is the file
+                                  <dir>/<table>_p<key>.db, ATTACHed as
+                                  <table>_p<key> when needed */
+} db_partition_options;
+
+// Partition `table` by time on this connection. db_insert into `table`
+// then goes to the partition of the row's timestamp, created on first use
+// with an index on the timestamp. Partitions left by earlier runs are
+// picked up. File partitions can not be attached inside a transaction, so
+// a row starting a new one must be inserted outside of one.
+int db_partition_table(sqlite3* db, const char* table,
+                       const db_partition_options* options);
+
+// db_query over the partitions overlapping [from_ts, to_ts), `to_ts` <= 0
+// for no upper bound. Other partitions are not read. `where`, `order_by`
+// and `limit` apply to the union, which is named `table`. NULL when
+// nothing matches, the range is empty or a partition can not be attached.
+// File partitions are all attached while the query runs, so a range may
+// span at most sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1) of them, 10 by
+// default and at most SQLITE_MAX_ATTACHED. Wider ranges return NULL, query
+// them in pieces or raise the limit.
+db_cursor db_partition_query(sqlite3* db, const char* table,
+                             db_column columns, int64_t from_ts,
+                             int64_t to_ts, const char* where,
+                             const char* order_by, const char* limit);
+
+// Drop the partitions that end before `ts`, keeping the one holding it.
+// A table partition is dropped with DROP TABLE, a file partition is
+// detached and deleted. `dropped` may be NULL.
+int db_partition_drop_before(sqlite3* db, const char* table, int64_t ts,
+                             int* dropped);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // PARTITION_H
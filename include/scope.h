@@ -0,0 +1,40 @@
+#ifndef SCOPE_H
+#define SCOPE_H
+
+#include <sqlite3.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Transaction scopes tracked per connection. Every db_query, cursor and
+// statement run on the connection in between shares the scope. Scopes nest
+// and must be ended in reverse order, ending the wrong kind returns
+// SQLITE_MISUSE.
+//
+// A scope belongs to the thread that began it and must be ended there,
+// ending it elsewhere returns SQLITE_MISUSE. Scopes begun on other threads
+// wait until its outermost scope ends, as do their db_insert, db_update,
+// db_delete, db_insert_struct, kv_put and kv_delete. Other statements of
+// other threads, queries included, run inside the open scope: do not share
+// the connection with code that writes by other means.
+
+// Pin one read snapshot until the matching db_read_end, so a group of
+// queries takes the shared lock once and sees consistent data. Nested in
+// another scope or transaction it only counts.
+int db_read_begin(sqlite3* db);
+int db_read_end(sqlite3* db);
+
+// The outermost write scope runs BEGIN IMMEDIATE, nested ones a SAVEPOINT
+// that commit releases and rollback undoes alone. Writing inside a read
+// scope fails with SQLITE_BUSY_SNAPSHOT once another connection has
+// committed since the snapshot was taken.
+int db_write_begin(sqlite3* db);
+int db_write_commit(sqlite3* db);
+int db_write_rollback(sqlite3* db);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // SCOPE_H
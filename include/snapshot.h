@@ -0,0 +1,44 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct db_snapshot_options {
+    const char* memdb_name;  /* NULL for a private :memory: database, else a
+                                memdb name other connections can open */
+    int pages_per_step;      /* Pages copied per backup step, default 64 */
+    int step_sleep_ms;       /* Pause between steps so readers get the
+                                connection, default 1, negative for none */
+    int interval_ms;         /* Snapshot period, 0 disables the thread */
+} db_snapshot_options;
+
+typedef struct db_snapshot_stats {
+    int64_t snapshots;         /* Completed snapshots */
+    int64_t failures;          /* Snapshots that failed */
+    int64_t last_duration_ms;  /* Wall time of the last snapshot */
+    int64_t max_duration_ms;   /* Slowest snapshot so far */
+    int64_t last_pages;        /* Pages written by the last snapshot */
+    int64_t lag_ms;            /* Time since the last completed snapshot */
+} db_snapshot_stats;
+
+// Load `db_path` into an in-memory database and keep persisting it back to
+// `db_path` in the background. `options` may be NULL for the defaults.
+// db_deinit stops the thread and writes a final snapshot.
+sqlite3* db_init_in_memory(const char* db_path,
+                           const db_snapshot_options* options);
+
+// Write a snapshot now, in incremental steps, on the calling thread.
+int db_snapshot_now(sqlite3* db);
+bool db_snapshot_get_stats(sqlite3* db, db_snapshot_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // SNAPSHOT_H
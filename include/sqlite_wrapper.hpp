@@ -0,0 +1,339 @@
+#ifndef SQLITE_WRAPPER_HPP
+#define SQLITE_WRAPPER_HPP
+
+// Header-only C++17 layer over the C API. Handles are move-only and release
+// their resources on scope exit. Arguments and columns are bound and read
+// with the sqlite3_bind_*/sqlite3_column_* call matching their C++ type,
+// chosen at compile time, so nothing goes through db_content.
+//
+//   sqlite_wrapper::Connection db("example.db");
+//   db.exec("INSERT INTO test(value, data) VALUES (?, ?)", 3, "text");
+//   for (auto [id, data] : db.query<int64_t, std::string_view>(
+//            "SELECT id, data FROM test WHERE value > ?", 1)) {
+//     ...
+//   }
+
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "sqlite_wrapper.h"
+#include "statement.h"
+
+namespace sqlite_wrapper {
+
+// Blob argument, the bytes are not copied by exec.
+struct Blob {
+  const void* data;
+  size_t size;
+};
+
+namespace detail {
+
+template <typename T>
+struct is_optional : std::false_type {};
+template <typename T>
+struct is_optional<std::optional<T>> : std::true_type {};
+
+// Integers sqlite3_bind_int/sqlite3_column_int hold without loss, wider and
+// unsigned ones go through the 64-bit calls.
+template <typename T>
+inline constexpr bool fits_int_v =
+    std::is_integral_v<T> &&
+    (sizeof(T) < sizeof(int) ||
+     (sizeof(T) == sizeof(int) && std::is_signed_v<T>));
+
+template <typename T>
+inline int bind_one(sqlite3_stmt* stmt, int idx, const T& value,
+                    sqlite3_destructor_type lifetime) {
+  using U = std::decay_t<T>;
+  if constexpr (std::is_same_v<U, std::nullptr_t>) {
+    return sqlite3_bind_null(stmt, idx);
+  } else if constexpr (is_optional<U>::value) {
+    return value ? bind_one(stmt, idx, *value, lifetime)
+                 : sqlite3_bind_null(stmt, idx);
+  } else if constexpr (fits_int_v<U>) {
+    return sqlite3_bind_int(stmt, idx, static_cast<int>(value));
+  } else if constexpr (std::is_integral_v<U>) {
+    // SQLite integers are signed 64-bit, larger values would wrap.
+    if constexpr (std::is_unsigned_v<U> && sizeof(U) >= sizeof(int64_t)) {
+      if (value > static_cast<U>(INT64_MAX))
+        return SQLITE_MISMATCH;
+    }
+    return sqlite3_bind_int64(stmt, idx, static_cast<sqlite3_int64>(value));
+  } else if constexpr (std::is_floating_point_v<U>) {
+    return sqlite3_bind_double(stmt, idx, static_cast<double>(value));
+  } else if constexpr (std::is_same_v<U, Blob>) {
+    return sqlite3_bind_blob64(stmt, idx, value.data, value.size, lifetime);
+  } else if constexpr (std::is_array_v<T>) {
+    return sqlite3_bind_text(stmt, idx, value, -1, lifetime);
+  } else if constexpr (std::is_same_v<U, const char*> ||
+                       std::is_same_v<U, char*>) {
+    return value ? sqlite3_bind_text(stmt, idx, value, -1, lifetime)
+                 : sqlite3_bind_null(stmt, idx);
+  } else {
+    static_assert(std::is_convertible_v<const T&, std::string_view>,
+                  "unsupported bind type");
+    std::string_view text(value);
+    return sqlite3_bind_text64(stmt, idx, text.data(), text.size(), lifetime,
+                               SQLITE_UTF8);
+  }
+}
+
+template <typename... Args>
+inline int bind_all([[maybe_unused]] sqlite3_stmt* stmt,
+                    [[maybe_unused]] sqlite3_destructor_type lifetime,
+                    const Args&... args) {
+  int rc = SQLITE_OK;
+  [[maybe_unused]] int idx = 1;
+  ((rc == SQLITE_OK ? (rc = bind_one(stmt, idx++, args, lifetime)) : 0), ...);
+  return rc;
+}
+
+template <typename T>
+inline T column(sqlite3_stmt* stmt, int col) {
+  if constexpr (is_optional<T>::value) {
+    if (sqlite3_column_type(stmt, col) == SQLITE_NULL)
+      return std::nullopt;
+    return column<typename T::value_type>(stmt, col);
+  } else if constexpr (std::is_same_v<T, bool>) {
+    return sqlite3_column_int(stmt, col) != 0;
+  } else if constexpr (fits_int_v<T>) {
+    return static_cast<T>(sqlite3_column_int(stmt, col));
+  } else if constexpr (std::is_integral_v<T>) {
+    return static_cast<T>(sqlite3_column_int64(stmt, col));
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return static_cast<T>(sqlite3_column_double(stmt, col));
+  } else if constexpr (std::is_same_v<T, std::string_view>) {
+    // Points into the row, valid until the statement moves on.
+    const char* text =
+        reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+    return text ? std::string_view(text, sqlite3_column_bytes(stmt, col))
+                : std::string_view();
+  } else if constexpr (std::is_same_v<T, const char*>) {
+    return reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+  } else if constexpr (std::is_same_v<T, std::string>) {
+    return std::string(column<std::string_view>(stmt, col));
+  } else if constexpr (std::is_same_v<T, Blob>) {
+    const void* data = sqlite3_column_blob(stmt, col);
+    return Blob{data, static_cast<size_t>(sqlite3_column_bytes(stmt, col))};
+  } else {
+    static_assert(sizeof(T) == 0, "unsupported column type");
+  }
+}
+
+template <typename... Ts, size_t... I>
+inline std::tuple<Ts...> row(sqlite3_stmt* stmt, std::index_sequence<I...>) {
+  return std::tuple<Ts...>(column<Ts>(stmt, static_cast<int>(I))...);
+}
+
+}  // namespace detail
+
+// Owns a db_stmt, so steps run under the busy policy and time budget of
+// the connection like the C API.
+class Statement {
+ public:
+  Statement() = default;
+  Statement(sqlite3* db, std::string_view sql)
+      : stmt_(db_prepare(db, std::string(sql).c_str())) {
+    rc_ = stmt_ ? SQLITE_OK : sqlite3_errcode(db);
+  }
+  ~Statement() { db_stmt_finalize(stmt_); }
+
+  Statement(Statement&& other) noexcept
+      : stmt_(std::exchange(other.stmt_, nullptr)), rc_(other.rc_) {}
+  Statement& operator=(Statement&& other) noexcept {
+    if (this != &other) {
+      db_stmt_finalize(stmt_);
+      stmt_ = std::exchange(other.stmt_, nullptr);
+      rc_ = other.rc_;
+    }
+    return *this;
+  }
+  Statement(const Statement&) = delete;
+  Statement& operator=(const Statement&) = delete;
+
+  explicit operator bool() const { return stmt_ != nullptr; }
+  sqlite3_stmt* get() const { return stmt_ ? db_stmt_handle(stmt_) : nullptr; }
+  // Result of the last prepare, bind or step.
+  int rc() const { return rc_; }
+
+  // Bind every argument in order. The values must outlive the next step.
+  template <typename... Args>
+  int bind(const Args&... args) {
+    rc_ = detail::bind_all(get(), SQLITE_STATIC, args...);
+    return rc_;
+  }
+
+  // SQLITE_ROW, SQLITE_DONE or an error code.
+  int step() {
+    rc_ = db_stmt_step(stmt_);
+    return rc_;
+  }
+
+  int reset() { return db_stmt_reset(stmt_); }
+
+  template <typename T>
+  T column(int col) const {
+    return detail::column<T>(get(), col);
+  }
+
+  template <typename... Ts>
+  std::tuple<Ts...> row() const {
+    return detail::row<Ts...>(get(), std::index_sequence_for<Ts...>());
+  }
+
+ private:
+  friend class Connection;
+
+  db_stmt stmt_ = nullptr;
+  int rc_ = SQLITE_MISUSE;
+};
+
+// Typed result set, iterate it with a range-for. Rows are produced by
+// stepping the statement, nothing is materialized.
+template <typename... Ts>
+class Rows {
+ public:
+  class iterator {
+   public:
+    using value_type = std::tuple<Ts...>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = value_type;
+    using iterator_category = std::input_iterator_tag;
+
+    iterator() = default;
+    explicit iterator(Rows* rows) : rows_(rows) {}
+
+    value_type operator*() const { return rows_->stmt_.template row<Ts...>(); }
+    iterator& operator++() {
+      if (rows_->stmt_.step() != SQLITE_ROW)
+        rows_ = nullptr;
+      return *this;
+    }
+    bool operator==(const iterator& other) const {
+      return rows_ == other.rows_;
+    }
+    bool operator!=(const iterator& other) const {
+      return rows_ != other.rows_;
+    }
+
+   private:
+    Rows* rows_ = nullptr;
+  };
+
+  explicit Rows(Statement stmt) : stmt_(std::move(stmt)) {}
+
+  iterator begin() {
+    if (!stmt_ || stmt_.rc() != SQLITE_OK)
+      return end();
+    return stmt_.step() == SQLITE_ROW ? iterator(this) : end();
+  }
+  iterator end() { return iterator(); }
+
+  // SQLITE_DONE once every row was read, otherwise the failing code.
+  int rc() const { return stmt_.rc(); }
+
+ private:
+  Statement stmt_;
+};
+
+// Owns a C cursor returned by db_query/db_query_sql.
+class Cursor {
+ public:
+  Cursor() = default;
+  explicit Cursor(db_cursor cursor) : cursor_(cursor) {}
+  ~Cursor() { cursorDelete(cursor_); }
+
+  Cursor(Cursor&& other) noexcept
+      : cursor_(std::exchange(other.cursor_, nullptr)) {}
+  Cursor& operator=(Cursor&& other) noexcept {
+    if (this != &other) {
+      cursorDelete(cursor_);
+      cursor_ = std::exchange(other.cursor_, nullptr);
+    }
+    return *this;
+  }
+  Cursor(const Cursor&) = delete;
+  Cursor& operator=(const Cursor&) = delete;
+
+  explicit operator bool() const { return cursor_ != nullptr; }
+  db_cursor get() const { return cursor_; }
+  // Move to the next row. Returns false at the end or on error.
+  bool next() { return cursor_ && cursor_next(cursor_) != nullptr; }
+
+ private:
+  db_cursor cursor_ = nullptr;
+};
+
+class Connection {
+ public:
+  Connection() = default;
+  explicit Connection(const char* path) : db_(db_init(path)) {}
+  // Take ownership of an open handle.
+  explicit Connection(sqlite3* db) : db_(db) {}
+  ~Connection() {
+    if (db_)
+      db_deinit(db_);
+  }
+
+  Connection(Connection&& other) noexcept
+      : db_(std::exchange(other.db_, nullptr)) {}
+  Connection& operator=(Connection&& other) noexcept {
+    if (this != &other) {
+      if (db_)
+        db_deinit(db_);
+      db_ = std::exchange(other.db_, nullptr);
+    }
+    return *this;
+  }
+  Connection(const Connection&) = delete;
+  Connection& operator=(const Connection&) = delete;
+
+  explicit operator bool() const { return db_ != nullptr; }
+  sqlite3* get() const { return db_; }
+
+  Statement prepare(std::string_view sql) const {
+    return Statement(db_, sql);
+  }
+
+  // Run a statement that returns no rows. Returns SQLITE_OK on success.
+  template <typename... Args>
+  int exec(std::string_view sql, const Args&... args) const {
+    Statement stmt(db_, sql);
+    if (stmt.rc() != SQLITE_OK)
+      return stmt.rc();
+
+    // The arguments outlive the step, no copies needed.
+    int rc = detail::bind_all(stmt.get(), SQLITE_STATIC, args...);
+    if (rc != SQLITE_OK)
+      return rc;
+
+    rc = stmt.step();
+    return rc == SQLITE_DONE || rc == SQLITE_ROW ? SQLITE_OK : rc;
+  }
+
+  template <typename... Ts, typename... Args>
+  Rows<Ts...> query(std::string_view sql, const Args&... args) const {
+    Statement stmt(db_, sql);
+    if (stmt.rc() == SQLITE_OK) {
+      // A range-for destroys temporaries in the range expression before
+      // the loop body runs, so text and blobs are copied here.
+      stmt.rc_ = detail::bind_all(stmt.get(), SQLITE_TRANSIENT, args...);
+    }
+    return Rows<Ts...>(std::move(stmt));
+  }
+
+ private:
+  sqlite3* db_ = nullptr;
+};
+
+}  // namespace sqlite_wrapper
+
+#endif  // SQLITE_WRAPPER_HPP
@@ -0,0 +1,54 @@
+#ifndef STATEMENT_H
+#define STATEMENT_H
+
+#include <sqlite3.h>
+#include <stdint.h>
+
+#include "cursor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct stmt_t* db_stmt;
+
+// Prepare once, then bind/step/reset as many times as needed.
+// Returns NULL when the SQL does not compile.
+db_stmt db_prepare(sqlite3* db, const char* sql);
+void db_stmt_finalize(db_stmt stmt);
+
+// Parameter indexes start at 1. Text and blobs are not copied, they must
+// stay valid until the statement is reset or rebound.
+int db_stmt_bind_null(db_stmt stmt, int idx);
+int db_stmt_bind_int(db_stmt stmt, int idx, int i);
+int db_stmt_bind_int64(db_stmt stmt, int idx, int64_t i);
+int db_stmt_bind_double(db_stmt stmt, int idx, double d);
+int db_stmt_bind_text(db_stmt stmt, int idx, const char* s, int len);
+int db_stmt_bind_blob(db_stmt stmt, int idx, const void* data, int len);
+
+// Bind by parameter name, including the prefix (":id", "@id", "$id").
+int db_stmt_bind_null_by_name(db_stmt stmt, const char* name);
+int db_stmt_bind_int_by_name(db_stmt stmt, const char* name, int i);
+int db_stmt_bind_int64_by_name(db_stmt stmt, const char* name, int64_t i);
+int db_stmt_bind_double_by_name(db_stmt stmt, const char* name, double d);
+int db_stmt_bind_text_by_name(db_stmt stmt, const char* name,
+                              const char* s, int len);
+int db_stmt_bind_blob_by_name(db_stmt stmt, const char* name,
+                              const void* data, int len);
+
+// Returns SQLITE_ROW, SQLITE_DONE or an error code.
+int db_stmt_step(db_stmt stmt);
+// Rewind the statement and clear its bindings for the next execution.
+int db_stmt_reset(db_stmt stmt);
+
+// A cursor over the current row of a stepped statement. Reading and
+// cursor_next work as usual; cursorDelete frees the cursor only, the
+// statement stays prepared.
+db_cursor db_stmt_cursor(db_stmt stmt);
+sqlite3_stmt* db_stmt_handle(db_stmt stmt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // STATEMENT_H
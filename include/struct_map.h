@@ -0,0 +1,75 @@
+#ifndef STRUCT_MAP_H
+#define STRUCT_MAP_H
+
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cursor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum field_type {
+    FIELD_INT = 1,     /* int */
+    FIELD_INT64,       /* int64_t */
+    FIELD_DOUBLE,      /* double */
+    FIELD_TEXT,        /* const char*, NULL maps to SQL NULL. On read it
+                          points into the row and is valid until the
+                          cursor moves */
+    FIELD_CHARS        /* char[N], copied and NUL-terminated on read */
+} field_type;
+
+typedef struct db_field {
+    const char* name;  /* Column name */
+    field_type type;
+    size_t offset;     /* offsetof the member */
+    size_t size;       /* sizeof the member */
+} db_field;
+
+typedef struct db_struct_map {
+    const char* table;
+    const db_field* fields;
+    size_t field_count;
+} db_struct_map;
+
+// Describe a struct member stored in the column of the same name.
+#define DB_FIELD(struct_type, member, type) \
+    { #member, type, offsetof(struct_type, member), \
+      sizeof(((struct_type*) 0)->member) }
+
+// Declare a static db_struct_map `map_name` for `table_name`:
+//   DB_STRUCT_MAP(user_map, "user",
+//                 DB_FIELD(user_t, id, FIELD_INT64),
+//                 DB_FIELD(user_t, name, FIELD_CHARS));
+#define DB_STRUCT_MAP(map_name, table_name, ...) \
+    static const db_field map_name##_fields[] = {__VA_ARGS__}; \
+    static const db_struct_map map_name = { \
+        table_name, map_name##_fields, \
+        sizeof(map_name##_fields) / sizeof(db_field)}
+
+// The INSERT statement of a map is prepared once per connection and reused.
+// Text fields are compressed like db_insert values. Partitioned tables are
+// not supported, inserting into one returns SQLITE_MISUSE: use db_insert.
+int db_insert_struct(sqlite3* db, const db_struct_map* map, const void* row);
+// Insert `count` structs laid out `stride` bytes apart in one write scope.
+int db_insert_structs(sqlite3* db, const db_struct_map* map,
+                      const void* rows, size_t count, size_t stride);
+
+// Select the mapped columns of `map->table`, in map order.
+db_cursor db_query_struct(sqlite3* db, const db_struct_map* map,
+                          const char* where, const char* order_by,
+                          const char* limit);
+// Fill `out` from the current row. Column indexes are resolved by name on
+// the first call and cached in the cursor. Fields without a matching
+// column are left untouched.
+bool cursor_read_struct(db_cursor cursor, const db_struct_map* map,
+                        void* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // STRUCT_MAP_H
@@ -0,0 +1,469 @@
+#include "allocator.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every block carries a small header so frees know the block size (for the
+// stats and SQLite's xSize) and whether it belongs to a pool.
+#define HEADER_SIZE 16
+#define POOL_GRANULARITY 16
+#define POOL_CLASSES 16
+#define POOL_MAX_FREE 1024
+
+enum alloc_source {
+  SOURCE_WRAPPER = 0,
+  SOURCE_SQLITE
+};
+
+struct block_header {
+  size_t size;
+  uint16_t pool_class;     /* 0 when the block is not pooled */
+  uint16_t source;
+  uint16_t tag;            /* db_mem_tag of a live wrapper block */
+};
+
+struct pool_list {
+  void *head;
+  int count;
+};
+
+// Counters of one thread. Only the owner updates them, with a load and a
+// store instead of a locked read-modify-write, so allocating threads never
+// contend. db_alloc_get_stats sums them, the accesses are atomic so it
+// reads whole values.
+struct alloc_counters {
+  int64_t allocations;
+  int64_t frees;
+  int64_t live_bytes;
+  int64_t flushed_bytes;    /* Part of live_bytes added to g_live_bytes */
+  int64_t pool_hits;
+  int64_t pool_misses;
+  int64_t pool_free_bytes;
+  int64_t sqlite_allocations;
+  int64_t sqlite_live_bytes;
+  int64_t tag_bytes[MEM_TAG_COUNT];
+  bool registered;
+  struct alloc_counters *prev;
+  struct alloc_counters *next;
+};
+
+// A thread's live bytes reach the shared total, which the peak is taken
+// from, once they moved by this much.
+#define PEAK_STEP_BYTES (64 * 1024)
+
+static void *default_malloc(size_t size, void *ctx) {
+  (void) ctx;
+  return malloc(size);
+}
+
+static void *default_realloc(void *ptr, size_t size, void *ctx) {
+  (void) ctx;
+  return realloc(ptr, size);
+}
+
+static void default_free(void *ptr, void *ctx) {
+  (void) ctx;
+  free(ptr);
+}
+
+static db_allocator g_allocator = {
+    default_malloc, default_realloc, default_free, NULL
+};
+
+static pthread_mutex_t g_counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct alloc_counters *g_threads = NULL;  /* Running threads */
+static struct alloc_counters g_retired;          /* Exited threads */
+static int64_t g_live_bytes = 0;                 /* Flushed live bytes */
+static int64_t g_peak_bytes = 0;
+
+static __thread struct alloc_counters t_counters;
+static __thread struct pool_list t_pools[POOL_CLASSES];
+static pthread_key_t g_pool_key;
+static pthread_once_t g_pool_key_once = PTHREAD_ONCE_INIT;
+
+static void thread_exit(void *arg);
+
+static void create_pool_key() {
+  pthread_key_create(&g_pool_key, thread_exit);
+}
+
+// The counters of the calling thread, registered on first use so they are
+// summed by the stats and folded into g_retired when the thread exits.
+static struct alloc_counters *counters() {
+  struct alloc_counters *c = &t_counters;
+  if (c->registered)
+    return c;
+
+  pthread_mutex_lock(&g_counters_lock);
+  c->prev = NULL;
+  c->next = g_threads;
+  if (g_threads)
+    g_threads->prev = c;
+  g_threads = c;
+  c->registered = true;
+  pthread_mutex_unlock(&g_counters_lock);
+
+  pthread_once(&g_pool_key_once, create_pool_key);
+  if (!pthread_getspecific(g_pool_key))
+    pthread_setspecific(g_pool_key, t_pools);
+  return c;
+}
+
+static void bump(int64_t *counter, int64_t delta) {
+  __atomic_store_n(counter, *counter + delta, __ATOMIC_RELAXED);
+}
+
+static void flush_live(struct alloc_counters *c) {
+  int64_t pending = c->live_bytes - c->flushed_bytes;
+  c->flushed_bytes = c->live_bytes;
+  int64_t live = __atomic_add_fetch(&g_live_bytes, pending, __ATOMIC_RELAXED);
+  int64_t peak = __atomic_load_n(&g_peak_bytes, __ATOMIC_RELAXED);
+  while (live > peak &&
+         !__atomic_compare_exchange_n(&g_peak_bytes, &peak, live, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static void add_live(struct alloc_counters *c, int tag, int64_t delta) {
+  bump(&c->live_bytes, delta);
+  bump(&c->tag_bytes[tag], delta);
+  int64_t pending = c->live_bytes - c->flushed_bytes;
+  if (pending >= PEAK_STEP_BYTES || pending <= -PEAK_STEP_BYTES)
+    flush_live(c);
+}
+
+static struct block_header *header_of(void *ptr) {
+  return (struct block_header *) ((char *) ptr - HEADER_SIZE);
+}
+
+static void *alloc_block(size_t size, int source) {
+  struct block_header *header = (struct block_header *)
+      g_allocator.malloc(size + HEADER_SIZE, g_allocator.ctx);
+  if (!header)
+    return NULL;
+
+  header->size = size;
+  header->pool_class = 0;
+  header->source = (uint16_t) source;
+  header->tag = MEM_OTHER;
+  return (char *) header + HEADER_SIZE;
+}
+
+static void count_alloc(size_t size) {
+  struct alloc_counters *c = counters();
+  bump(&c->allocations, 1);
+  add_live(c, MEM_OTHER, (int64_t) size);
+}
+
+static void count_free(size_t size, int tag) {
+  struct alloc_counters *c = counters();
+  bump(&c->frees, 1);
+  add_live(c, tag, -(int64_t) size);
+}
+
+void db_set_allocator(const db_allocator *allocator) {
+  if (allocator) {
+    g_allocator = *allocator;
+  } else {
+    g_allocator.malloc = default_malloc;
+    g_allocator.realloc = default_realloc;
+    g_allocator.free = default_free;
+    g_allocator.ctx = NULL;
+  }
+}
+
+void *db_malloc(size_t size) {
+  void *ptr = alloc_block(size, SOURCE_WRAPPER);
+  if (ptr)
+    count_alloc(size);
+  return ptr;
+}
+
+void *db_calloc(size_t count, size_t size) {
+  void *ptr = db_malloc(count * size);
+  if (ptr)
+    memset(ptr, 0, count * size);
+  return ptr;
+}
+
+void *db_realloc(void *ptr, size_t size) {
+  if (!ptr)
+    return db_malloc(size);
+
+  struct block_header *header = header_of(ptr);
+  if (header->pool_class) {
+    // Pooled blocks have a fixed size, move the data out of the pool.
+    void *moved = db_malloc(size);
+    if (moved) {
+      memcpy(moved, ptr, header->size < size ? header->size : size);
+      db_tag(moved, (db_mem_tag) header->tag);
+      db_pool_free(ptr);
+    }
+
+    return moved;
+  }
+
+  size_t old_size = header->size;
+  header = (struct block_header *)
+      g_allocator.realloc(header, size + HEADER_SIZE, g_allocator.ctx);
+  if (!header)
+    return NULL;
+
+  header->size = size;
+  add_live(counters(), header->tag, (int64_t) size - (int64_t) old_size);
+  return (char *) header + HEADER_SIZE;
+}
+
+void db_free(void *ptr) {
+  if (!ptr)
+    return;
+
+  struct block_header *header = header_of(ptr);
+  if (header->pool_class) {
+    db_pool_free(ptr);
+    return;
+  }
+
+  count_free(header->size, header->tag);
+  g_allocator.free(header, g_allocator.ctx);
+}
+
+void *db_tag(void *ptr, db_mem_tag tag) {
+  if (!ptr || tag < 0 || tag >= MEM_TAG_COUNT)
+    return ptr;
+
+  struct block_header *header = header_of(ptr);
+  if (header->tag != tag) {
+    struct alloc_counters *c = counters();
+    bump(&c->tag_bytes[header->tag], -(int64_t) header->size);
+    bump(&c->tag_bytes[tag], (int64_t) header->size);
+    header->tag = (uint16_t) tag;
+  }
+
+  return ptr;
+}
+
+char *db_strdup(const char *s) {
+  if (!s)
+    return NULL;
+
+  size_t len = strlen(s);
+  char *copy = (char *) db_malloc(len + 1);
+  if (copy)
+    memcpy(copy, s, len + 1);
+  return copy;
+}
+
+static void drain_pools(struct pool_list *pools) {
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    while (pools[i].head) {
+      void *ptr = pools[i].head;
+      pools[i].head = *(void **) ptr;
+      bump(&counters()->pool_free_bytes, -(int64_t) header_of(ptr)->size);
+      g_allocator.free(header_of(ptr), g_allocator.ctx);
+    }
+
+    pools[i].count = 0;
+  }
+}
+
+void db_pool_trim() {
+  drain_pools(t_pools);
+}
+
+static void retire(struct alloc_counters *from) {
+  struct alloc_counters *to = &g_retired;
+  to->allocations += from->allocations;
+  to->frees += from->frees;
+  to->live_bytes += from->live_bytes;
+  to->pool_hits += from->pool_hits;
+  to->pool_misses += from->pool_misses;
+  to->pool_free_bytes += from->pool_free_bytes;
+  to->sqlite_allocations += from->sqlite_allocations;
+  to->sqlite_live_bytes += from->sqlite_live_bytes;
+  for (int i = 0; i < MEM_TAG_COUNT; i++) {
+    to->tag_bytes[i] += from->tag_bytes[i];
+  }
+}
+
+// Runs when a thread that used the allocator exits: its free lists go back
+// to the allocator and its counters into g_retired. A later allocation from
+// another destructor registers it again.
+static void thread_exit(void *arg) {
+  drain_pools((struct pool_list *) arg);
+  struct alloc_counters *c = &t_counters;
+  if (!c->registered)
+    return;
+
+  flush_live(c);
+  pthread_mutex_lock(&g_counters_lock);
+  if (c->prev) {
+    c->prev->next = c->next;
+  } else {
+    g_threads = c->next;
+  }
+  if (c->next)
+    c->next->prev = c->prev;
+  retire(c);
+  memset(c, 0, sizeof(*c));
+  pthread_mutex_unlock(&g_counters_lock);
+}
+
+void *db_pool_alloc(size_t size) {
+  size_t pool_class = (size + POOL_GRANULARITY - 1) / POOL_GRANULARITY;
+  if (pool_class == 0)
+    pool_class = 1;
+  if (pool_class > POOL_CLASSES)
+    return db_malloc(size);
+
+  struct pool_list *pool = &t_pools[pool_class - 1];
+  void *ptr = pool->head;
+  if (ptr) {
+    pool->head = *(void **) ptr;
+    pool->count--;
+    header_of(ptr)->tag = MEM_OTHER;
+    bump(&counters()->pool_free_bytes, -(int64_t) header_of(ptr)->size);
+    bump(&counters()->pool_hits, 1);
+  } else {
+    ptr = alloc_block(pool_class * POOL_GRANULARITY, SOURCE_WRAPPER);
+    if (!ptr)
+      return NULL;
+
+    header_of(ptr)->pool_class = (uint16_t) pool_class;
+    bump(&counters()->pool_misses, 1);
+  }
+
+  count_alloc(pool_class * POOL_GRANULARITY);
+  return ptr;
+}
+
+void db_pool_free(void *ptr) {
+  if (!ptr)
+    return;
+
+  struct block_header *header = header_of(ptr);
+  if (!header->pool_class) {
+    db_free(ptr);
+    return;
+  }
+
+  count_free(header->size, header->tag);
+  // Blocks go to the free list of the thread releasing them.
+  struct pool_list *pool = &t_pools[header->pool_class - 1];
+  if (pool->count >= POOL_MAX_FREE) {
+    g_allocator.free(header, g_allocator.ctx);
+    return;
+  }
+
+  // count_free registered the thread, its lists are drained when it exits.
+  *(void **) ptr = pool->head;
+  pool->head = ptr;
+  pool->count++;
+  bump(&counters()->pool_free_bytes, (int64_t) header->size);
+}
+
+static void *sqlite_malloc(int size) {
+  void *ptr = alloc_block((size_t) size, SOURCE_SQLITE);
+  if (ptr) {
+    struct alloc_counters *c = counters();
+    bump(&c->sqlite_allocations, 1);
+    bump(&c->sqlite_live_bytes, size);
+  }
+
+  return ptr;
+}
+
+static void sqlite_free(void *ptr) {
+  if (!ptr)
+    return;
+
+  struct block_header *header = header_of(ptr);
+  bump(&counters()->sqlite_live_bytes, -(int64_t) header->size);
+  g_allocator.free(header, g_allocator.ctx);
+}
+
+static void *sqlite_realloc(void *ptr, int size) {
+  struct block_header *header = header_of(ptr);
+  int64_t old_size = (int64_t) header->size;
+  header = (struct block_header *)
+      g_allocator.realloc(header, (size_t) size + HEADER_SIZE,
+                          g_allocator.ctx);
+  if (!header)
+    return NULL;
+
+  header->size = (size_t) size;
+  bump(&counters()->sqlite_live_bytes, size - old_size);
+  return (char *) header + HEADER_SIZE;
+}
+
+static int sqlite_size(void *ptr) {
+  return ptr ? (int) header_of(ptr)->size : 0;
+}
+
+static int sqlite_roundup(int size) {
+  return (size + 7) & ~7;
+}
+
+static int sqlite_init(void *app_data) {
+  (void) app_data;
+  return SQLITE_OK;
+}
+
+static void sqlite_shutdown(void *app_data) {
+  (void) app_data;
+}
+
+static const sqlite3_mem_methods g_sqlite_methods = {
+    sqlite_malloc, sqlite_free, sqlite_realloc, sqlite_size,
+    sqlite_roundup, sqlite_init, sqlite_shutdown, NULL
+};
+
+int db_use_allocator_for_sqlite() {
+  return sqlite3_config(SQLITE_CONFIG_MALLOC, &g_sqlite_methods);
+}
+
+int db_config_page_cache(void *buffer, int page_size, int pages) {
+  return sqlite3_config(SQLITE_CONFIG_PAGECACHE, buffer, page_size, pages);
+}
+
+int db_config_lookaside(sqlite3 *db, int slot_size, int slots) {
+  // SQLite allocates the buffer itself when it is passed NULL.
+  return sqlite3_db_config(db, SQLITE_DBCONFIG_LOOKASIDE, NULL,
+                           slot_size, slots);
+}
+
+static void add_counters(db_alloc_stats *stats, struct alloc_counters *c) {
+  stats->allocations += __atomic_load_n(&c->allocations, __ATOMIC_RELAXED);
+  stats->frees += __atomic_load_n(&c->frees, __ATOMIC_RELAXED);
+  stats->live_bytes += __atomic_load_n(&c->live_bytes, __ATOMIC_RELAXED);
+  stats->pool_hits += __atomic_load_n(&c->pool_hits, __ATOMIC_RELAXED);
+  stats->pool_misses += __atomic_load_n(&c->pool_misses, __ATOMIC_RELAXED);
+  stats->pool_free_bytes +=
+      __atomic_load_n(&c->pool_free_bytes, __ATOMIC_RELAXED);
+  stats->sqlite_allocations +=
+      __atomic_load_n(&c->sqlite_allocations, __ATOMIC_RELAXED);
+  stats->sqlite_live_bytes +=
+      __atomic_load_n(&c->sqlite_live_bytes, __ATOMIC_RELAXED);
+  for (int i = 0; i < MEM_TAG_COUNT; i++) {
+    stats->tag_bytes[i] += __atomic_load_n(&c->tag_bytes[i], __ATOMIC_RELAXED);
+  }
+}
+
+void db_alloc_get_stats(db_alloc_stats *stats) {
+  if (!stats)
+    return;
+
+  memset(stats, 0, sizeof(*stats));
+  pthread_mutex_lock(&g_counters_lock);
+  add_counters(stats, &g_retired);
+  for (struct alloc_counters *c = g_threads; c; c = c->next) {
+    add_counters(stats, c);
+  }
+
+  pthread_mutex_unlock(&g_counters_lock);
+  // The shared peak lags each thread by less than PEAK_STEP_BYTES.
+  stats->peak_bytes = __atomic_load_n(&g_peak_bytes, __ATOMIC_RELAXED);
+  if (stats->live_bytes > stats->peak_bytes)
+    stats->peak_bytes = stats->live_bytes;
+}
@@ -0,0 +1,232 @@
+#include "busy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "connection.h"
+
+static const int DEFAULT_INITIAL_BACKOFF_US = 100;
+static const int DEFAULT_MAX_BACKOFF_US = 50000;
+static const int DEFAULT_DEADLINE_MS = 5000;
+static const int DEFAULT_MAX_RETRIES = 3;
+
+struct busy_t {
+  sqlite3 *db;
+  db_busy_policy policy;
+  int64_t wait_start_ms;    /* Start of the current busy wait */
+
+  pthread_mutex_t lock;     /* Guards the stats */
+  db_busy_stats stats;
+};
+
+static int64_t get_time_in_ms() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t) (now.tv_sec * 1000 + now.tv_usec / 1000);
+}
+
+static int bucket_of(int64_t value) {
+  int bucket = 0;
+  while (value > 0 && bucket < DB_BUSY_HISTOGRAM_BUCKETS - 1) {
+    value >>= 1;
+    bucket++;
+  }
+
+  return bucket;
+}
+
+// Jitter state. Callers of one connection may run on several threads, so
+// each thread draws from its own.
+static __thread unsigned int t_seed;
+
+static int backoff_us(struct busy_t *busy, int count) {
+  int64_t backoff = busy->policy.initial_backoff_us;
+  for (int i = 0; i < count && backoff < busy->policy.max_backoff_us; i++) {
+    backoff *= 2;
+  }
+
+  if (backoff > busy->policy.max_backoff_us)
+    backoff = busy->policy.max_backoff_us;
+  // Sleep somewhere in [backoff / 2, backoff] so waiting writers do not
+  // wake up in lockstep.
+  int half = (int) (backoff / 2);
+  if (t_seed == 0)
+    t_seed = (unsigned int) (uintptr_t) &t_seed ^
+             (unsigned int) get_time_in_ms();
+  return half + (half > 0 ? rand_r(&t_seed) % (half + 1) : 0);
+}
+
+static int busy_handler(void *arg, int count) {
+  struct busy_t *busy = (struct busy_t *) arg;
+  int64_t now = get_time_in_ms();
+  if (count == 0)
+    busy->wait_start_ms = now;
+
+  pthread_mutex_lock(&busy->lock);
+  busy->stats.busy_waits++;
+  if (now - busy->wait_start_ms >= busy->policy.deadline_ms ||
+      deadline_expired(busy->db)) {
+    busy->stats.timeouts++;
+    pthread_mutex_unlock(&busy->lock);
+    return 0;
+  }
+
+  pthread_mutex_unlock(&busy->lock);
+  usleep(backoff_us(busy, count));
+  return 1;
+}
+
+static void apply_defaults(db_busy_policy *policy) {
+  if (policy->initial_backoff_us <= 0)
+    policy->initial_backoff_us = DEFAULT_INITIAL_BACKOFF_US;
+  if (policy->max_backoff_us <= 0)
+    policy->max_backoff_us = DEFAULT_MAX_BACKOFF_US;
+  if (policy->deadline_ms <= 0)
+    policy->deadline_ms = DEFAULT_DEADLINE_MS;
+  if (policy->max_retries == 0)
+    policy->max_retries = DEFAULT_MAX_RETRIES;
+  else if (policy->max_retries < 0)
+    policy->max_retries = 0;
+}
+
+int db_set_busy_policy(sqlite3 *db, const db_busy_policy *policy) {
+  connection_t *conn = connection_get(db);
+  if (!conn)
+    return SQLITE_MISUSE;
+
+  pthread_mutex_lock(&conn->lock);
+  struct busy_t *busy = conn->busy;
+  if (!busy) {
+    busy = (struct busy_t *) db_calloc(1, sizeof(struct busy_t));
+    busy->db = db;
+    pthread_mutex_init(&busy->lock, NULL);
+    conn->busy = busy;
+  }
+
+  if (policy) {
+    busy->policy = *policy;
+  } else {
+    memset(&busy->policy, 0, sizeof(db_busy_policy));
+  }
+
+  apply_defaults(&busy->policy);
+  pthread_mutex_unlock(&conn->lock);
+  return sqlite3_busy_handler(db, busy_handler, busy);
+}
+
+bool db_busy_get_stats(sqlite3 *db, db_busy_stats *stats) {
+  connection_t *conn = connection_find(db);
+  if (!conn || !conn->busy || !stats)
+    return false;
+
+  pthread_mutex_lock(&conn->busy->lock);
+  *stats = conn->busy->stats;
+  pthread_mutex_unlock(&conn->busy->lock);
+  return true;
+}
+
+static struct busy_t *find_busy(sqlite3 *db) {
+  connection_t *conn = connection_find(db);
+  return conn ? conn->busy : NULL;
+}
+
+static bool is_contention(int rc) {
+  rc &= 0xff;
+  return rc == SQLITE_BUSY || rc == SQLITE_LOCKED;
+}
+
+static void record(struct busy_t *busy, int retries, int64_t waited_ms,
+                   bool failed) {
+  pthread_mutex_lock(&busy->lock);
+  busy->stats.retries += retries;
+  if (failed)
+    busy->stats.failures++;
+  busy->stats.wait_ms_histogram[bucket_of(waited_ms)]++;
+  busy->stats.retry_histogram[retries < DB_BUSY_HISTOGRAM_BUCKETS
+                              ? retries : DB_BUSY_HISTOGRAM_BUCKETS - 1]++;
+  pthread_mutex_unlock(&busy->lock);
+}
+
+static int64_t busy_waits(struct busy_t *busy) {
+  pthread_mutex_lock(&busy->lock);
+  int64_t waits = busy->stats.busy_waits;
+  pthread_mutex_unlock(&busy->lock);
+  return waits;
+}
+
+int busy_step(sqlite3 *db, sqlite3_stmt *stmt) {
+  // A statement that already returned rows cannot be restarted without
+  // returning them again, so the following rows skip the bookkeeping. Its
+  // locks are held by then and the busy handler still times any wait.
+  if (sqlite3_stmt_busy(stmt))
+    return sqlite3_step(stmt);
+
+  struct busy_t *busy = find_busy(db);
+  if (!busy)
+    return sqlite3_step(stmt);
+
+  int64_t start = get_time_in_ms();
+  int64_t waits = busy_waits(busy);
+  int retries = 0;
+  int rc = sqlite3_step(stmt);
+  // Inside an explicit transaction the caller has to roll back to get out
+  // of a deadlock, retrying the statement alone cannot help.
+  while (is_contention(rc) && retries < busy->policy.max_retries &&
+         sqlite3_get_autocommit(db) && !deadline_expired(db)) {
+    sqlite3_reset(stmt);
+    usleep(backoff_us(busy, retries++));
+    rc = sqlite3_step(stmt);
+  }
+
+  if (retries > 0 || busy_waits(busy) != waits) {
+    record(busy, retries, get_time_in_ms() - start, is_contention(rc));
+  }
+
+  return rc;
+}
+
+int busy_exec(sqlite3 *db, const char *sql, char **errmsg) {
+  struct busy_t *busy = find_busy(db);
+  if (!busy)
+    return sqlite3_exec(db, sql, NULL, NULL, errmsg);
+
+  if (errmsg)
+    *errmsg = NULL;
+  // Run the statements one at a time: those before the one hitting the
+  // lock may be committed already, so only that one is retried.
+  const char *tail = sql;
+  int rc = SQLITE_OK;
+  while (rc == SQLITE_OK && tail && *tail) {
+    sqlite3_stmt *stmt = NULL;
+    rc = sqlite3_prepare_v2(db, tail, -1, &stmt, &tail);
+    if (rc != SQLITE_OK || !stmt)
+      break;
+
+    while ((rc = busy_step(db, stmt)) == SQLITE_ROW) {
+    }
+
+    rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+    if (rc != SQLITE_OK && errmsg)
+      *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+  }
+
+  if (rc != SQLITE_OK && errmsg && !*errmsg)
+    *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  return rc;
+}
+
+void busy_release(connection_t *conn) {
+  if (!conn->busy)
+    return;
+
+  // Closing the handle may still wait on locks, do not leave it pointing
+  // at freed state.
+  sqlite3_busy_handler(conn->db, NULL, NULL);
+  pthread_mutex_destroy(&conn->busy->lock);
+  db_free(conn->busy);
+  conn->busy = NULL;
+}
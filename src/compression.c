@@ -0,0 +1,387 @@
+#include "compression.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "connection.h"
+
+static const size_t DEFAULT_THRESHOLD = 256;
+
+// Block format in the spirit of LZ4: a sequence is a token byte (literal
+// length << 4 | match length - MIN_MATCH), extra length bytes of 255 when a
+// nibble is 15, the literals, a 2-byte little-endian offset and the extra
+// match length bytes. The last sequence carries literals only.
+#define MIN_MATCH 4
+#define HASH_BITS 12
+#define MAX_OFFSET 65535
+
+// Header of a stored value: the magic, a flags byte and the original
+// length as a little-endian uint32, followed by the payload.
+#define HEADER_SIZE 8
+#define FLAG_TEXT 0x01        /* Original value was TEXT, otherwise BLOB */
+#define FLAG_COMPRESSED 0x02  /* Payload is compressed, otherwise raw */
+static const uint8_t MAGIC[3] = {0xc0, 'L', 'Z'};
+
+struct compress_rule_t {
+  char *key;                /* "table" or "table.column", lower case */
+  size_t threshold;
+  UT_hash_handle hh;
+};
+
+static int g_rule_count = 0;
+static db_compress_stats g_stats;
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, const uint8_t *oend, size_t len) {
+  while (len >= 255) {
+    if (op >= oend)
+      return NULL;
+    *op++ = 255;
+    len -= 255;
+  }
+
+  if (op >= oend)
+    return NULL;
+  *op++ = (uint8_t) len;
+  return op;
+}
+
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend,
+                             const uint8_t *literals, size_t literal_len,
+                             size_t offset, size_t match_len) {
+  if (op >= oend)
+    return NULL;
+
+  size_t match_code = match_len ? match_len - MIN_MATCH : 0;
+  uint8_t *token = op++;
+  *token = (uint8_t) ((literal_len < 15 ? literal_len : 15) << 4 |
+                      (match_code < 15 ? match_code : 15));
+  if (literal_len >= 15 && !(op = put_length(op, oend, literal_len - 15)))
+    return NULL;
+  if ((size_t) (oend - op) < literal_len)
+    return NULL;
+  memcpy(op, literals, literal_len);
+  op += literal_len;
+
+  if (!match_len)
+    return op;
+  if (oend - op < 2)
+    return NULL;
+  *op++ = (uint8_t) (offset & 0xff);
+  *op++ = (uint8_t) (offset >> 8);
+  if (match_code >= 15 && !(op = put_length(op, oend, match_code - 15)))
+    return NULL;
+  return op;
+}
+
+// Returns the compressed size, or 0 when it does not fit in `cap`.
+static size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst,
+                          size_t cap) {
+  uint32_t table[1 << HASH_BITS];
+  memset(table, 0, sizeof(table));
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *end = src + n;
+  uint8_t *op = dst;
+  const uint8_t *oend = dst + cap;
+
+  while (n >= MIN_MATCH && ip <= end - MIN_MATCH) {
+    uint32_t seq = read32(ip);
+    uint32_t h = hash4(seq);
+    const uint8_t *ref = src + table[h];
+    table[h] = (uint32_t) (ip - src);
+    if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+      ip++;
+      continue;
+    }
+
+    const uint8_t *mp = ip + MIN_MATCH;
+    const uint8_t *rp = ref + MIN_MATCH;
+    while (mp < end && *mp == *rp) {
+      mp++;
+      rp++;
+    }
+
+    op = put_sequence(op, oend, anchor, (size_t) (ip - anchor),
+                      (size_t) (ip - ref), (size_t) (mp - ip));
+    if (!op)
+      return 0;
+    ip = anchor = mp;
+  }
+
+  op = put_sequence(op, oend, anchor, (size_t) (end - anchor), 0, 0);
+  return op ? (size_t) (op - dst) : 0;
+}
+
+static bool get_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+  uint8_t b;
+  do {
+    if (*ip >= iend)
+      return false;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+
+  return true;
+}
+
+// Expand exactly `n` bytes, checking every read and write.
+static bool lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                          size_t n) {
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + len;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + n;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+    size_t literal_len = token >> 4;
+    if (literal_len == 15 && !get_length(&ip, iend, &literal_len))
+      return false;
+    if ((size_t) (iend - ip) < literal_len ||
+        (size_t) (oend - op) < literal_len)
+      return false;
+    memcpy(op, ip, literal_len);
+    ip += literal_len;
+    op += literal_len;
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return false;
+    size_t offset = ip[0] | (size_t) ip[1] << 8;
+    ip += 2;
+    size_t match_len = token & 0x0f;
+    if (match_len == 15 && !get_length(&ip, iend, &match_len))
+      return false;
+    match_len += MIN_MATCH;
+    if (offset == 0 || offset > (size_t) (op - dst) ||
+        (size_t) (oend - op) < match_len)
+      return false;
+
+    // Byte by byte, the match may overlap the bytes it produces.
+    const uint8_t *ref = op - offset;
+    for (size_t i = 0; i < match_len; i++) {
+      op[i] = ref[i];
+    }
+
+    op += match_len;
+  }
+
+  return op == oend;
+}
+
+// SQLite identifiers are case insensitive, so are the rules.
+static char *rule_key(const char *table, const char *column) {
+  size_t len = strlen(table) + (column ? strlen(column) + 1 : 0) + 1;
+  char *key = (char *) db_tag(db_malloc(len), MEM_CACHE);
+  if (column)
+    snprintf(key, len, "%s.%s", table, column);
+  else
+    snprintf(key, len, "%s", table);
+  for (char *p = key; *p; p++) {
+    *p = (char) tolower((unsigned char) *p);
+  }
+
+  return key;
+}
+
+int db_compress_column(sqlite3 *db, const char *table, const char *column,
+                       size_t threshold) {
+  if (!table)
+    return SQLITE_MISUSE;
+
+  connection_t *conn = connection_get(db);
+  if (!conn)
+    return SQLITE_MISUSE;
+
+  char *key = rule_key(table, column);
+  pthread_mutex_lock(&conn->lock);
+  struct compress_rule_t *rule = NULL;
+  HASH_FIND_STR(conn->compress_rules, key, rule);
+  if (!rule) {
+    rule = (struct compress_rule_t *)
+        db_tag(db_calloc(1, sizeof(struct compress_rule_t)), MEM_CACHE);
+    rule->key = key;
+    HASH_ADD_STR(conn->compress_rules, key, rule);
+    __atomic_fetch_add(&g_rule_count, 1, __ATOMIC_RELAXED);
+  } else {
+    db_free(key);
+  }
+
+  rule->threshold = threshold ? threshold : DEFAULT_THRESHOLD;
+  pthread_mutex_unlock(&conn->lock);
+  return SQLITE_OK;
+}
+
+void db_compress_get_stats(db_compress_stats *stats) {
+  if (!stats)
+    return;
+
+  stats->compressed = __atomic_load_n(&g_stats.compressed, __ATOMIC_RELAXED);
+  stats->skipped = __atomic_load_n(&g_stats.skipped, __ATOMIC_RELAXED);
+  stats->input_bytes = __atomic_load_n(&g_stats.input_bytes, __ATOMIC_RELAXED);
+  stats->output_bytes =
+      __atomic_load_n(&g_stats.output_bytes, __ATOMIC_RELAXED);
+  stats->decompressed =
+      __atomic_load_n(&g_stats.decompressed, __ATOMIC_RELAXED);
+}
+
+static size_t lookup_threshold(connection_t *conn, const char *table,
+                               const char *column) {
+  size_t threshold = 0;
+  char *key = rule_key(table, column);
+  pthread_mutex_lock(&conn->lock);
+  if (conn->compress_rules) {
+    struct compress_rule_t *rule = NULL;
+    HASH_FIND_STR(conn->compress_rules, key, rule);
+    if (!rule) {
+      db_free(key);
+      key = rule_key(table, NULL);
+      HASH_FIND_STR(conn->compress_rules, key, rule);
+    }
+
+    threshold = rule ? rule->threshold : 0;
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+  db_free(key);
+  return threshold;
+}
+
+// Threshold that applies to `table`.`column`, 0 when it is not compressed.
+// Rows read back from a table partition name the partition, the rules are
+// those of the partitioned table.
+static size_t find_threshold(sqlite3 *db, const char *table,
+                             const char *column) {
+  connection_t *conn = connection_find(db);
+  if (!conn || !table || !column)
+    return 0;
+
+  size_t threshold = lookup_threshold(conn, table, column);
+  if (threshold == 0) {
+    const char *parent = partition_parent(db, table);
+    if (parent)
+      threshold = lookup_threshold(conn, parent, column);
+  }
+
+  return threshold;
+}
+
+bool compressed_column(sqlite3 *db, const char *table, const char *column) {
+  if (__atomic_load_n(&g_rule_count, __ATOMIC_RELAXED) == 0)
+    return false;
+
+  return find_threshold(db, table, column) > 0;
+}
+
+static void put_header(uint8_t *out, uint8_t flags, size_t len) {
+  memcpy(out, MAGIC, sizeof(MAGIC));
+  out[3] = flags;
+  out[4] = (uint8_t) (len & 0xff);
+  out[5] = (uint8_t) (len >> 8 & 0xff);
+  out[6] = (uint8_t) (len >> 16 & 0xff);
+  out[7] = (uint8_t) (len >> 24 & 0xff);
+}
+
+bool compress_value(sqlite3 *db, const char *table, const char *column,
+                    bool text, const void *data, size_t len, void **out,
+                    size_t *out_len) {
+  if (__atomic_load_n(&g_rule_count, __ATOMIC_RELAXED) == 0)
+    return false;
+
+  size_t threshold = find_threshold(db, table, column);
+  if (threshold == 0 || len > UINT32_MAX)
+    return false;
+
+  uint8_t flags = text ? FLAG_TEXT : 0;
+  if (len >= threshold) {
+    // Only worth it when the result is smaller than the value itself.
+    uint8_t *packed = (uint8_t *) db_malloc(len);
+    size_t packed_len = len > HEADER_SIZE
+        ? lz_compress((const uint8_t *) data, len, packed + HEADER_SIZE,
+                      len - HEADER_SIZE - 1)
+        : 0;
+    if (packed_len > 0) {
+      put_header(packed, flags | FLAG_COMPRESSED, len);
+      *out = packed;
+      *out_len = packed_len + HEADER_SIZE;
+      __atomic_fetch_add(&g_stats.compressed, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&g_stats.input_bytes, (int64_t) len,
+                         __ATOMIC_RELAXED);
+      __atomic_fetch_add(&g_stats.output_bytes, (int64_t) *out_len,
+                         __ATOMIC_RELAXED);
+      return true;
+    }
+
+    db_free(packed);
+    __atomic_fetch_add(&g_stats.skipped, 1, __ATOMIC_RELAXED);
+  }
+
+  // A plain BLOB that happens to start with the magic would be taken for
+  // a compressed one when read back, store it behind a raw header.
+  if (!text && len >= sizeof(MAGIC) && memcmp(data, MAGIC, sizeof(MAGIC)) == 0) {
+    uint8_t *raw = (uint8_t *) db_malloc(len + HEADER_SIZE);
+    put_header(raw, flags, len);
+    memcpy(raw + HEADER_SIZE, data, len);
+    *out = raw;
+    *out_len = len + HEADER_SIZE;
+    return true;
+  }
+
+  return false;
+}
+
+bool compressed_header(const void *data, size_t len, bool *text,
+                       size_t *original_len) {
+  const uint8_t *p = (const uint8_t *) data;
+  if (!p || len < HEADER_SIZE || memcmp(p, MAGIC, sizeof(MAGIC)) != 0 ||
+      (p[3] & ~(FLAG_TEXT | FLAG_COMPRESSED)) != 0)
+    return false;
+
+  *text = (p[3] & FLAG_TEXT) != 0;
+  *original_len = (size_t) p[4] | (size_t) p[5] << 8 |
+                  (size_t) p[6] << 16 | (size_t) p[7] << 24;
+  return true;
+}
+
+bool decompress_value(const void *data, size_t len, void *out,
+                      size_t original_len) {
+  const uint8_t *p = (const uint8_t *) data;
+  if (!(p[3] & FLAG_COMPRESSED)) {
+    if (len - HEADER_SIZE != original_len)
+      return false;
+    memcpy(out, p + HEADER_SIZE, original_len);
+    return true;
+  }
+
+  if (!lz_decompress(p + HEADER_SIZE, len - HEADER_SIZE, (uint8_t *) out,
+                     original_len)) {
+    printf("corrupt compressed value (%zu bytes)\n", len);
+    return false;
+  }
+
+  __atomic_fetch_add(&g_stats.decompressed, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+void compression_release(connection_t *conn) {
+  struct compress_rule_t *rule, *tmp;
+  HASH_ITER(hh, conn->compress_rules, rule, tmp) {
+    HASH_DEL(conn->compress_rules, rule);
+    __atomic_fetch_sub(&g_rule_count, 1, __ATOMIC_RELAXED);
+    db_free(rule->key);
+    db_free(rule);
+  }
+}
@@ -0,0 +1,66 @@
+#include "connection.h"
+
+#include "busy.h"
+#include "deadline.h"
+
+static connection_t *g_connections = NULL;
+static pthread_mutex_t g_connections_lock = PTHREAD_MUTEX_INITIALIZER;
+
+connection_t *connection_find(sqlite3 *db) {
+  connection_t *conn = NULL;
+  pthread_mutex_lock(&g_connections_lock);
+  HASH_FIND_PTR(g_connections, &db, conn);
+  pthread_mutex_unlock(&g_connections_lock);
+  return conn;
+}
+
+connection_t *connection_get(sqlite3 *db) {
+  if (!db)
+    return NULL;
+
+  connection_t *conn = NULL;
+  pthread_mutex_lock(&g_connections_lock);
+  HASH_FIND_PTR(g_connections, &db, conn);
+  if (conn == NULL) {
+    conn = (connection_t *) db_calloc(1, sizeof(connection_t));
+    conn->db = db;
+    pthread_mutex_init(&conn->lock, NULL);
+    HASH_ADD_PTR(g_connections, db, conn);
+  }
+
+  pthread_mutex_unlock(&g_connections_lock);
+  return conn;
+}
+
+void connection_setup(sqlite3 *db) {
+  db_set_busy_policy(db, NULL);
+  db_set_timeout(db, 0);
+}
+
+void connection_release(sqlite3 *db) {
+  connection_t *conn = NULL;
+  pthread_mutex_lock(&g_connections_lock);
+  HASH_FIND_PTR(g_connections, &db, conn);
+  if (conn != NULL) {
+    HASH_DEL(g_connections, conn);
+  }
+
+  pthread_mutex_unlock(&g_connections_lock);
+  if (!conn)
+    return;
+
+  // The maintenance thread uses its own handle but hooks commits on `db`.
+  maintenance_release(conn);
+  struct_stmts_release(conn->struct_stmts);
+  diagnostics_release(conn);
+  busy_release(conn);
+  deadline_release(conn);
+  compression_release(conn);
+  partition_release(conn);
+  scope_release(conn);
+  snapshot_release(conn->snapshot);
+  // Registered functions are owned by SQLite and freed through their
+  // destructor when the handle is closed.
+  pthread_mutex_destroy(&conn->lock);
+  db_free(conn);
+}
@@ -0,0 +1,137 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "allocator.h"
+#include "cursor.h"
+#include "query_builder.h"
+
+#define uthash_malloc(sz) db_malloc(sz)
+#define uthash_free(ptr, sz) db_free(ptr)
+#include "uthash.h"
+
+// Wrapper state attached to an open sqlite3 handle. The public API keeps
+// passing raw sqlite3 pointers around, so per-connection state is looked up
+// from a process-wide table keyed by the handle.
+
+struct function_t;
+struct snapshot_t;
+struct struct_stmt_t;
+struct plan_t;
+struct busy_t;
+struct deadline_t;
+struct compress_rule_t;
+struct maintenance_t;
+struct partition_t;
+struct scope_t;
+
+typedef struct connection_t {
+  sqlite3 *db;              /* Key */
+  pthread_mutex_t lock;     /* Guards the fields below */
+  struct function_t *functions;
+  struct snapshot_t *snapshot;
+  struct struct_stmt_t *struct_stmts;
+  bool diagnostics;
+  struct plan_t *plans;
+  struct busy_t *busy;
+  struct deadline_t *deadline;
+  struct compress_rule_t *compress_rules;
+  struct maintenance_t *maintenance;
+  struct partition_t *partitions;
+  struct scope_t *scope;
+  UT_hash_handle hh;
+} connection_t;
+
+// Find the state of `db`, creating it on first use.
+connection_t *connection_get(sqlite3 *db);
+// Find the state of `db`, or NULL if nothing was ever attached to it.
+connection_t *connection_find(sqlite3 *db);
+// Apply the defaults every connection opened by the wrapper starts with.
+void connection_setup(sqlite3 *db);
+// Drop the state of `db`. Called by db_deinit before the handle is closed.
+void connection_release(sqlite3 *db);
+
+// Teardown of the per-module state, called from connection_release.
+void snapshot_release(struct snapshot_t *snapshot);
+void struct_stmts_release(struct struct_stmt_t *stmts);
+void diagnostics_release(connection_t *conn);
+void busy_release(connection_t *conn);
+void deadline_release(connection_t *conn);
+void compression_release(connection_t *conn);
+void maintenance_release(connection_t *conn);
+void partition_release(connection_t *conn);
+void scope_release(connection_t *conn);
+
+// Finalize the cached struct inserts no caller is using.
+void struct_stmts_trim(connection_t *conn);
+// Drop the recorded plans, they are rebuilt as statements run again.
+void diagnostics_trim(connection_t *conn);
+
+// Record the counters of `stmt` when diagnostics are on for `db`. Called
+// right before a statement is reset or finalized.
+void diagnostics_observe(sqlite3 *db, sqlite3_stmt *stmt);
+
+// Bracket a write made outside of a scope. It waits while another thread
+// has a scope open, so it neither joins that transaction nor is undone by
+// its rollback. Inside a scope of the calling thread it joins it.
+void scope_enter(sqlite3 *db);
+void scope_leave(sqlite3 *db);
+
+// sqlite3_step/sqlite3_exec that retry on SQLITE_BUSY/SQLITE_LOCKED
+// according to the busy policy of `db`.
+int busy_step(sqlite3 *db, sqlite3_stmt *stmt);
+int busy_exec(sqlite3 *db, const char *sql, char **errmsg);
+
+// The budget of one statement, resolved when it starts and kept by the
+// caller for the following steps. Zero it before the first step.
+typedef struct step_deadline_t {
+  struct deadline_t *deadline;  /* NULL when `db` has no budget state */
+  int64_t expires_ms;           /* 0 for none */
+} step_deadline_t;
+
+// busy_step/busy_exec under the time budget of `db`. SQLITE_INTERRUPT is
+// reported as DB_DEADLINE_EXCEEDED or DB_CANCELLED when that was the cause.
+int deadline_step(sqlite3 *db, sqlite3_stmt *stmt, step_deadline_t *budget);
+int deadline_exec(sqlite3 *db, const char *sql, char **errmsg);
+// Whether the budget of the step running on `db` is spent.
+bool deadline_expired(sqlite3 *db);
+
+// Encode a TEXT or BLOB value bound to `table`.`column` when a compression
+// rule applies. On true `out` holds `out_len` bytes to bind as a BLOB,
+// release it with db_free.
+bool compress_value(sqlite3 *db, const char *table, const char *column,
+                    bool text, const void *data, size_t len, void **out,
+                    size_t *out_len);
+// Bind TEXT or BLOB bytes to parameter `idx`, encoded when a compression
+// rule applies to `table`.`column`. Unencoded bytes are bound SQLITE_STATIC.
+void bind_bytes(sqlite3 *db, const char *table, const char *column,
+                sqlite3_stmt *stmt, int idx, bool text, const void *data,
+                size_t len);
+// Whether a compression rule applies to `table`.`column`. Values of other
+// columns are never decoded, whatever bytes they start with.
+bool compressed_column(sqlite3 *db, const char *table, const char *column);
+// Whether a BLOB read back is an encoded value, and what it expands to.
+bool compressed_header(const void *data, size_t len, bool *text,
+                       size_t *original_len);
+// Expand an encoded value into `original_len` bytes at `out`.
+bool decompress_value(const void *data, size_t len, void *out,
+                      size_t original_len);
+
+// The partition a row inserted into `table` goes to, as `target`, when
+// `table` is partitioned. `target` is NULL otherwise.
+int partition_route(sqlite3 *db, const char *table, db_content content,
+                    string *target);
+// Whether rows inserted into `table` are routed to partitions.
+bool partitioned(sqlite3 *db, const char *table);
+// The partitioned table a table partition named `name` belongs to, or NULL.
+// Valid until db_deinit.
+const char *partition_parent(sqlite3 *db, const char *name);
+
+// Carry the deadline of a statement stepped before the cursor was created.
+void cursor_set_deadline(db_cursor cursor, step_deadline_t budget);
+
+#endif  // CONNECTION_H
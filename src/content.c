@@ -3,6 +3,10 @@
 #include <stdarg.h>
 #include <string.h>
 
+#include "allocator.h"
+
+#define uthash_malloc(sz) db_tag(db_malloc(sz), MEM_CONTENT)
+#define uthash_free(ptr, sz) db_free(ptr)
 #include "uthash.h"
 
 static const size_t DEFAULT_COLUMNS_SIZE = 4;
@@ -11,6 +15,7 @@ struct value_t {
   double d;     /* Float value used when MEM_Real is set in flags */
   int64_t i;    /* Integer value used when MEM_Int is set in flags */
   char *s;      /* String value used when valueStr is set in flags */
+  size_t n;     /* Length of a blob kept in s */
 
   value_type flag;
 };
@@ -28,15 +33,18 @@ struct column_t {
 };
 
 static db_content contentConstructor(const char *key) {
-  db_content data =
-      (db_content) calloc(1, sizeof(struct content_t));
-  data->key = (char *) malloc(strlen(key) + 1);
-  strcpy(data->key, key);
-  data->value =
-      (db_value) calloc(1, sizeof(struct value_t));
+  // Entries and values are small and churn on every insert/update, so
+  // they come from the per-thread pools.
+  db_content data = (db_content)
+      db_tag(db_pool_alloc(sizeof(struct content_t)), MEM_CONTENT);
+  memset(data, 0, sizeof(struct content_t));
+  data->key = (char *) db_tag(db_strdup(key), MEM_CONTENT);
+  data->value = (db_value)
+      db_tag(db_pool_alloc(sizeof(struct value_t)), MEM_CONTENT);
   data->value->d = 0;
   data->value->i = 0;
   data->value->s = NULL;
+  data->value->n = 0;
   data->value->flag = VALUE_NULL;
   return data;
 }
@@ -58,8 +66,7 @@ void content_insert_text(db_content *data, const char *key, const char *s) {
   }
 
   tmp->value->flag = VALUE_TEXT;
-  tmp->value->s = (char *) malloc(strlen(s) + 1);
-  strcpy(tmp->value->s, s);
+  tmp->value->s = (char *) db_tag(db_strdup(s), MEM_CONTENT);
 }
 
 void content_insert_int(db_content *data, const char *key, int i) {
@@ -86,24 +93,45 @@ void content_insert_double(db_content *data, const char *key, double d) {
   tmp->value->d = d;
 }
 
+void content_insert_blob(db_content *data, const char *key, const void *blob,
+                         size_t len) {
+  if (!blob)
+    return;
+
+  db_content tmp;
+  HASH_FIND_STR(*data, key, tmp);  /* value already in the hash? */
+  if (tmp == NULL) {
+    tmp = contentConstructor(key);
+    HASH_ADD_STR(*data, key, tmp);
+  } else if (tmp->value->flag == VALUE_TEXT ||
+             tmp->value->flag == VALUE_BLOB) {
+    db_free(tmp->value->s);
+  }
+
+  tmp->value->flag = VALUE_BLOB;
+  tmp->value->s = (char *) db_tag(db_malloc(len ? len : 1), MEM_CONTENT);
+  memcpy(tmp->value->s, blob, len);
+  tmp->value->n = len;
+}
+
 void content_erase(db_content *data, const char *key) {
   db_content tmp;
   HASH_FIND_STR(*data, key, tmp);
   if (tmp != NULL) {
     HASH_DEL(*data, tmp);  /* user: pointer to deletee */
     if (tmp->key) {
-      free(tmp->key);
+      db_free(tmp->key);
     }
 
     if (tmp->value) {
-      if (tmp->value->flag == VALUE_TEXT) {
-        free(tmp->value->s);
+      if (tmp->value->flag == VALUE_TEXT || tmp->value->flag == VALUE_BLOB) {
+        db_free(tmp->value->s);
       }
 
-      free(tmp->value);
+      db_pool_free(tmp->value);
     }
 
-    free(tmp);
+    db_pool_free(tmp);
   }
 }
 
@@ -146,18 +174,19 @@ void content_delete(db_content data) {
   HASH_ITER(hh, data, current, tmp) {
     HASH_DEL(data, current);
     if (current->key) {
-      free(current->key);
+      db_free(current->key);
     }
 
     if (current->value) {
-      if (current->value->flag == VALUE_TEXT) {
-        free(current->value->s);
+      if (current->value->flag == VALUE_TEXT ||
+          current->value->flag == VALUE_BLOB) {
+        db_free(current->value->s);
       }
 
-      free(current->value);
+      db_pool_free(current->value);
     }
 
-    free(current);
+    db_pool_free(current);
   }
 }
 
@@ -220,6 +249,22 @@ double content_get_double(db_value data) {
   return 0;
 }
 
+const void *content_get_blob(db_value value) {
+  if (value && value->flag == VALUE_BLOB) {
+    return value->s;
+  }
+
+  return NULL;
+}
+
+size_t content_get_bytes(db_value value) {
+  if (value && value->flag == VALUE_BLOB) {
+    return value->n;
+  }
+
+  return 0;
+}
+
 void columns_push(db_column *columns, const char *column) {
   const size_t len = strlen(column);
   if (len == 0)
@@ -228,38 +273,42 @@ void columns_push(db_column *columns, const char *column) {
   db_column cur = *columns;
   if ((cur)->size + 1 > (cur)->capacity) {
     (cur)->capacity *= 2;
-    char **tmp = (char **) calloc(1, sizeof(char *) * (cur)->capacity);
+    char **tmp = (char **)
+        db_tag(db_calloc(1, sizeof(char *) * (cur)->capacity), MEM_CONTENT);
     for (int i = 0; i < cur->size; i++) {
       tmp[i] = cur->names[i];
     }
 
-    free((cur)->names);
+    db_free((cur)->names);
     cur->names = tmp;
   }
 
-  cur->names[cur->size] = malloc(strlen(column) + 1);
-  strcpy(cur->names[cur->size], column);
+  cur->names[cur->size] = (char *) db_tag(db_strdup(column), MEM_CONTENT);
   cur->size++;
 }
 
 db_column columns_new() {
-  db_column columns = (db_column) malloc(sizeof(struct column_t));
-  columns->names = (char **) calloc(1, sizeof(char *) * DEFAULT_COLUMNS_SIZE);
+  db_column columns = (db_column)
+      db_tag(db_malloc(sizeof(struct column_t)), MEM_CONTENT);
+  columns->names = (char **) db_tag(
+      db_calloc(1, sizeof(char *) * DEFAULT_COLUMNS_SIZE), MEM_CONTENT);
   columns->size = 0;
   columns->capacity = DEFAULT_COLUMNS_SIZE;
   return columns;
 }
 
 db_column columns_new_with_name(int column_num, ...) {
-  db_column columns = (db_column) malloc(sizeof(struct column_t));
-  columns->names = (char **) calloc(1, sizeof(char *) * column_num);
+  db_column columns = (db_column)
+      db_tag(db_malloc(sizeof(struct column_t)), MEM_CONTENT);
+  columns->names = (char **)
+      db_tag(db_calloc(1, sizeof(char *) * column_num), MEM_CONTENT);
   columns->size = 0;
   va_list vl;
   va_start(vl, column_num);
   for (int i = 0; i < column_num; i++) {
     char *column = va_arg(vl, char*);
-    columns->names[columns->size] = malloc(strlen(column) + 1);
-    strcpy(columns->names[columns->size++], column);
+    columns->names[columns->size++] =
+        (char *) db_tag(db_strdup(column), MEM_CONTENT);
   }
 
   va_end(vl);
@@ -286,10 +335,10 @@ void columns_delete(db_column columns) {
 
   for (int i = 0; i < columns->size; i++) {
     if (columns->names[i]) {
-      free(columns->names[i]);
+      db_free(columns->names[i]);
     }
   }
 
-  free(columns->names);
-  free(columns);
+  db_free(columns->names);
+  db_free(columns);
 }
\ No newline at end of file
@@ -4,25 +4,71 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "allocator.h"
+#include "connection.h"
+#include "deadline.h"
+#include "struct_map.h"
+
+// A compressed column expanded for the current row.
+struct unpacked_t {
+  char *data;
+  size_t capacity;
+  size_t len;
+  int64_t row;              /* Row it was expanded for, 0 for none */
+  int rule;                 /* 1 if the column has a compression rule, -1 if
+                               not, 0 until looked up */
+};
+
 struct cursor_t {
   // sqlite3* db is used to print errmsg
   sqlite3 *db;
   sqlite3_stmt *stmt;
+  bool owns_stmt;
+  step_deadline_t budget;
+  int status;
+  // Column index of every field of the last map read by cursor_read_struct
+  const db_struct_map *map;
+  int *map_index;
+  // Buffers reused from row to row, allocated on the first compressed value
+  struct unpacked_t *unpacked;
+  int unpacked_count;
+  int64_t row;
 };
 
 db_cursor cursor_new(sqlite3 *db, sqlite3_stmt *stmt) {
-  db_cursor cursor = (db_cursor) malloc(sizeof(struct cursor_t));
+  db_cursor cursor = (db_cursor)
+      db_tag(db_pool_alloc(sizeof(struct cursor_t)), MEM_CURSOR);
   cursor->stmt = stmt;
   cursor->db = db;
+  cursor->owns_stmt = true;
+  cursor->budget.deadline = NULL;
+  cursor->budget.expires_ms = 0;
+  cursor->status = SQLITE_ROW;
+  cursor->map = NULL;
+  cursor->map_index = NULL;
+  cursor->unpacked = NULL;
+  cursor->unpacked_count = 0;
+  cursor->row = 1;
+  return cursor;
+}
+
+db_cursor cursor_new_borrowed(sqlite3 *db, sqlite3_stmt *stmt) {
+  db_cursor cursor = cursor_new(db, stmt);
+  cursor->owns_stmt = false;
   return cursor;
 }
 
 db_cursor cursor_next(db_cursor cursor) {
-  int rc = sqlite3_step(cursor->stmt);
+  int rc = deadline_step(cursor->db, cursor->stmt, &cursor->budget);
+  cursor->status = rc;
   if (rc == SQLITE_ROW) {
+    cursor->row++;
     return cursor;
   } else if (rc != SQLITE_DONE) {
-    printf("get next cursor error: %s\n", sqlite3_errmsg(cursor->db));
+    // A budget spent between two rows never reached SQLite.
+    printf("get next cursor error(%d): %s\n", rc,
+           rc == DB_DEADLINE_EXCEEDED ? "deadline exceeded"
+                                      : sqlite3_errmsg(cursor->db));
     return NULL;
   }
 
@@ -30,14 +76,126 @@ db_cursor cursor_next(db_cursor cursor) {
   return NULL;
 }
 
+int cursor_status(db_cursor cursor) {
+  return cursor ? cursor->status : SQLITE_MISUSE;
+}
+
+void cursor_set_deadline(db_cursor cursor, step_deadline_t budget) {
+  cursor->budget = budget;
+}
+
+// The state of column `col`, NULL for a column no rule applies to. Rules
+// are looked up by the table and column the result column comes from, once
+// per cursor.
+static struct unpacked_t *coded_column(db_cursor cursor, int col) {
+  if (!cursor->unpacked) {
+    cursor->unpacked_count = cursor_column_count(cursor);
+    cursor->unpacked = (struct unpacked_t *) db_tag(
+        db_calloc(cursor->unpacked_count, sizeof(struct unpacked_t)),
+        MEM_CURSOR);
+  }
+
+  if (col < 0 || col >= cursor->unpacked_count)
+    return NULL;
+
+  struct unpacked_t *unpacked = &cursor->unpacked[col];
+  if (unpacked->rule == 0) {
+    const char *table = sqlite3_column_table_name(cursor->stmt, col);
+    const char *column = sqlite3_column_origin_name(cursor->stmt, col);
+    unpacked->rule =
+        table && column && compressed_column(cursor->db, table, column)
+        ? 1 : -1;
+  }
+
+  return unpacked->rule > 0 ? unpacked : NULL;
+}
+
+// Whether column `col` holds an encoded value of a column with a rule.
+static struct unpacked_t *coded_value(db_cursor cursor, int col, bool *text,
+                                      size_t *original_len) {
+  if (sqlite3_column_type(cursor->stmt, col) != SQLITE_BLOB)
+    return NULL;
+
+  struct unpacked_t *unpacked = coded_column(cursor, col);
+  if (!unpacked ||
+      !compressed_header(sqlite3_column_blob(cursor->stmt, col),
+                         (size_t) sqlite3_column_bytes(cursor->stmt, col),
+                         text, original_len))
+    return NULL;
+
+  // The length comes from the stored bytes, no value SQLite accepts can be
+  // longer.
+  if (*original_len > (size_t) sqlite3_limit(cursor->db, SQLITE_LIMIT_LENGTH,
+                                             -1))
+    return NULL;
+
+  return unpacked;
+}
+
+// Expand column `col` if it holds a compressed value. The result stays valid
+// until the cursor moves, like the pointers SQLite returns.
+static struct unpacked_t *unpack(db_cursor cursor, int col, bool *text) {
+  size_t original_len = 0;
+  struct unpacked_t *unpacked = coded_value(cursor, col, text, &original_len);
+  if (!unpacked)
+    return NULL;
+
+  const void *raw = sqlite3_column_blob(cursor->stmt, col);
+  size_t len = (size_t) sqlite3_column_bytes(cursor->stmt, col);
+  // The statement of a borrowed cursor can be stepped behind its back.
+  if (cursor->owns_stmt && unpacked->row == cursor->row)
+    return unpacked;
+
+  if (unpacked->capacity < original_len + 1) {
+    char *data = (char *) db_tag(db_malloc(original_len + 1), MEM_CURSOR);
+    if (!data)
+      return NULL;
+
+    db_free(unpacked->data);
+    unpacked->data = data;
+    unpacked->capacity = original_len + 1;
+  }
+
+  if (!decompress_value(raw, len, unpacked->data, original_len))
+    return NULL;
+
+  unpacked->data[original_len] = '\0';
+  unpacked->len = original_len;
+  unpacked->row = cursor->row;
+  return unpacked;
+}
+
 int cursor_get_int(db_cursor cursor, int col) {
   return sqlite3_column_int(cursor->stmt, col);
 }
 
 const char *cursor_get_text(db_cursor cursor, int col) {
+  bool text = false;
+  struct unpacked_t *unpacked = unpack(cursor, col, &text);
+  if (unpacked)
+    return unpacked->data;
+
   return (const char *) sqlite3_column_text(cursor->stmt, col);
 }
 
+const void *cursor_get_blob(db_cursor cursor, int col) {
+  bool text = false;
+  struct unpacked_t *unpacked = unpack(cursor, col, &text);
+  if (unpacked)
+    return unpacked->data;
+
+  return sqlite3_column_blob(cursor->stmt, col);
+}
+
+int cursor_get_bytes(db_cursor cursor, int col) {
+  bool text = false;
+  struct unpacked_t *unpacked = unpack(cursor, col, &text);
+  if (unpacked)
+    return (int) unpacked->len;
+
+  return sqlite3_column_bytes(cursor->stmt, col);
+}
+
 double cursor_get_double(db_cursor cursor, int col) {
   return sqlite3_column_double(cursor->stmt, col);
 }
@@ -52,8 +210,15 @@ value_type cursor_get_column_type(db_cursor cursor, int col) {
       break;
     case SQLITE_FLOAT:type = VALUE_DOUBLE;
       break;
-    case SQLITE_BLOB:type = VALUE_BLOB;
+    case SQLITE_BLOB: {
+      // Compressed TEXT still reads as TEXT.
+      bool text = false;
+      size_t original_len = 0;
+      if (!coded_value(cursor, col, &text, &original_len))
+        text = false;
+      type = text ? VALUE_TEXT : VALUE_BLOB;
       break;
+    }
     case SQLITE_NULL:type = VALUE_NULL;
       break;
     default:printf("not support type: %d\n", t);
@@ -83,10 +248,84 @@ int cursor_get_column_index(db_cursor cursor, const char *column_name) {
   return -1;
 }
 
+static void resolve_map(db_cursor cursor, const db_struct_map *map) {
+  db_free(cursor->map_index);
+  cursor->map = map;
+  cursor->map_index = (int *)
+      db_tag(db_malloc(sizeof(int) * map->field_count), MEM_CURSOR);
+  int count = cursor_column_count(cursor);
+  for (size_t i = 0; i < map->field_count; i++) {
+    cursor->map_index[i] = -1;
+    for (int col = 0; col < count; col++) {
+      if (sqlite3_stricmp(sqlite3_column_name(cursor->stmt, col),
+                          map->fields[i].name) == 0) {
+        cursor->map_index[i] = col;
+        break;
+      }
+    }
+  }
+}
+
+bool cursor_read_struct(db_cursor cursor, const db_struct_map *map,
+                        void *out) {
+  if (!cursor || !map || !out)
+    return false;
+
+  if (cursor->map != map)
+    resolve_map(cursor, map);
+
+  char *row = (char *) out;
+  for (size_t i = 0; i < map->field_count; i++) {
+    const db_field *field = &map->fields[i];
+    int col = cursor->map_index[i];
+    if (col < 0)
+      continue;
+
+    char *member = row + field->offset;
+    switch (field->type) {
+      case FIELD_INT:*(int *) member = sqlite3_column_int(cursor->stmt, col);
+        break;
+      case FIELD_INT64:
+        *(int64_t *) member = sqlite3_column_int64(cursor->stmt, col);
+        break;
+      case FIELD_DOUBLE:
+        *(double *) member = sqlite3_column_double(cursor->stmt, col);
+        break;
+      case FIELD_TEXT:
+        *(const char **) member = cursor_get_text(cursor, col);
+        break;
+      case FIELD_CHARS: {
+        const char *text = cursor_get_text(cursor, col);
+        size_t len = text ? (size_t) cursor_get_bytes(cursor, col) : 0;
+        if (field->size == 0)
+          break;
+        if (len >= field->size)
+          len = field->size - 1;
+        if (len > 0)
+          memcpy(member, text, len);
+        member[len] = '\0';
+        break;
+      }
+      default:printf("Not support field type: %d\n", field->type);
+    }
+  }
+
+  return true;
+}
+
 void cursorDelete(db_cursor cursor) {
   if (!cursor)
     return;
 
-  sqlite3_finalize(cursor->stmt);
-  free(cursor);
+  if (cursor->owns_stmt) {
+    diagnostics_observe(cursor->db, cursor->stmt);
+    sqlite3_finalize(cursor->stmt);
+  }
+  db_free(cursor->map_index);
+  for (int i = 0; i < cursor->unpacked_count; i++) {
+    db_free(cursor->unpacked[i].data);
+  }
+
+  db_free(cursor->unpacked);
+  db_pool_free(cursor);
 }
\ No newline at end of file
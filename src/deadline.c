@@ -0,0 +1,183 @@
+#include "deadline.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "connection.h"
+
+// VM instructions between two deadline checks. A check costs one clock read
+// and an instruction is a few nanoseconds, so this keeps the overhead well
+// under 1% while still noticing an expired budget within a millisecond or so.
+static const int CHECK_INTERVAL = 1000;
+
+struct deadline_t {
+  int timeout_ms;           /* Budget of every statement, 0 for none */
+  int call_timeout_ms;      /* Budget of the next statement only, 0 for none */
+  bool installed;           /* Progress handler registered */
+  int64_t expires_ms;       /* Deadline of the running step, 0 for none */
+  int tripped;              /* Set by the progress handler on expiry */
+  int cancelled;            /* Set by db_cancel */
+  int last_status;
+};
+
+// Deadlines must not move with the wall clock.
+static int64_t get_time_in_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int progress_handler(void *arg) {
+  struct deadline_t *deadline = (struct deadline_t *) arg;
+  int64_t expires = __atomic_load_n(&deadline->expires_ms, __ATOMIC_RELAXED);
+  if (expires == 0 || get_time_in_ms() < expires)
+    return 0;
+
+  __atomic_store_n(&deadline->tripped, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+static int set_budget(sqlite3 *db, int timeout_ms, bool once) {
+  connection_t *conn = connection_get(db);
+  if (!conn)
+    return SQLITE_MISUSE;
+
+  pthread_mutex_lock(&conn->lock);
+  struct deadline_t *deadline = conn->deadline;
+  if (!deadline) {
+    deadline = (struct deadline_t *) db_calloc(1, sizeof(struct deadline_t));
+    deadline->last_status = SQLITE_OK;
+    conn->deadline = deadline;
+  }
+
+  __atomic_store_n(once ? &deadline->call_timeout_ms : &deadline->timeout_ms,
+                   timeout_ms > 0 ? timeout_ms : 0, __ATOMIC_RELAXED);
+  // Only pay for the handler once a budget is used, it stays installed
+  // afterwards and is a no-op while nothing is armed.
+  if (timeout_ms > 0 && !deadline->installed) {
+    deadline->installed = true;
+    sqlite3_progress_handler(db, CHECK_INTERVAL, progress_handler, deadline);
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+  return SQLITE_OK;
+}
+
+int db_set_timeout(sqlite3 *db, int timeout_ms) {
+  return set_budget(db, timeout_ms, false);
+}
+
+int db_set_call_timeout(sqlite3 *db, int timeout_ms) {
+  return set_budget(db, timeout_ms, true);
+}
+
+int db_cancel(sqlite3 *db) {
+  if (!db)
+    return SQLITE_MISUSE;
+
+  connection_t *conn = connection_find(db);
+  if (conn && conn->deadline)
+    __atomic_store_n(&conn->deadline->cancelled, 1, __ATOMIC_RELAXED);
+  sqlite3_interrupt(db);
+  return SQLITE_OK;
+}
+
+int db_last_status(sqlite3 *db) {
+  connection_t *conn = connection_find(db);
+  if (!conn || !conn->deadline)
+    return sqlite3_errcode(db);
+
+  return conn->deadline->last_status;
+}
+
+static struct deadline_t *find_deadline(sqlite3 *db) {
+  connection_t *conn = connection_find(db);
+  return conn ? conn->deadline : NULL;
+}
+
+// Start the budget of a new statement.
+static int64_t arm(struct deadline_t *deadline) {
+  int timeout = __atomic_exchange_n(&deadline->call_timeout_ms, 0,
+                                    __ATOMIC_RELAXED);
+  if (timeout == 0)
+    timeout = __atomic_load_n(&deadline->timeout_ms, __ATOMIC_RELAXED);
+  // A cancel sent while nothing ran is dropped, like sqlite3_interrupt.
+  __atomic_store_n(&deadline->cancelled, 0, __ATOMIC_RELAXED);
+  return timeout > 0 ? get_time_in_ms() + timeout : 0;
+}
+
+static int finish(struct deadline_t *deadline, int64_t expires_ms, int rc) {
+  __atomic_store_n(&deadline->expires_ms, 0, __ATOMIC_RELAXED);
+  bool tripped = __atomic_exchange_n(&deadline->tripped, 0, __ATOMIC_RELAXED);
+  bool expired = expires_ms != 0 && get_time_in_ms() >= expires_ms;
+  switch (rc & 0xff) {
+    case SQLITE_INTERRUPT:
+      if (tripped)
+        rc = DB_DEADLINE_EXCEEDED;
+      else if (__atomic_exchange_n(&deadline->cancelled, 0, __ATOMIC_RELAXED))
+        rc = DB_CANCELLED;
+      break;
+    case SQLITE_BUSY:
+    case SQLITE_LOCKED:
+      // The busy handler gave up because the budget ran out.
+      if (expired)
+        rc = DB_DEADLINE_EXCEEDED;
+      break;
+  }
+
+  deadline->last_status = rc;
+  return rc;
+}
+
+bool deadline_expired(sqlite3 *db) {
+  struct deadline_t *deadline = find_deadline(db);
+  if (!deadline)
+    return false;
+
+  int64_t expires = __atomic_load_n(&deadline->expires_ms, __ATOMIC_RELAXED);
+  return expires != 0 && get_time_in_ms() >= expires;
+}
+
+int deadline_step(sqlite3 *db, sqlite3_stmt *stmt, step_deadline_t *budget) {
+  // The state is looked up once per statement, the following rows reuse it.
+  // It lives until db_deinit, which no statement outlives.
+  if (!sqlite3_stmt_busy(stmt)) {
+    budget->deadline = find_deadline(db);
+    budget->expires_ms = budget->deadline ? arm(budget->deadline) : 0;
+  }
+
+  struct deadline_t *deadline = budget->deadline;
+  if (!deadline)
+    return busy_step(db, stmt);
+
+  // The caller may have spent the rest of the budget between two rows.
+  int64_t expires_ms = budget->expires_ms;
+  if (expires_ms != 0 && get_time_in_ms() >= expires_ms)
+    return finish(deadline, expires_ms, DB_DEADLINE_EXCEEDED);
+
+  __atomic_store_n(&deadline->expires_ms, expires_ms, __ATOMIC_RELAXED);
+  int rc = busy_step(db, stmt);
+  return finish(deadline, expires_ms, rc);
+}
+
+int deadline_exec(sqlite3 *db, const char *sql, char **errmsg) {
+  struct deadline_t *deadline = find_deadline(db);
+  if (!deadline)
+    return busy_exec(db, sql, errmsg);
+
+  int64_t expires_ms = arm(deadline);
+  __atomic_store_n(&deadline->expires_ms, expires_ms, __ATOMIC_RELAXED);
+  int rc = busy_exec(db, sql, errmsg);
+  return finish(deadline, expires_ms, rc);
+}
+
+void deadline_release(connection_t *conn) {
+  if (!conn->deadline)
+    return;
+
+  if (conn->deadline->installed)
+    sqlite3_progress_handler(conn->db, 0, NULL, NULL);
+  db_free(conn->deadline);
+  conn->deadline = NULL;
+}
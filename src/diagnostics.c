@@ -0,0 +1,455 @@
+#include "diagnostics.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "connection.h"
+#include "query_builder.h"
+
+struct plan_t {
+  char *key;           /* SQL text */
+  char *plan;          /* EXPLAIN QUERY PLAN details, one per line */
+  char *suggestion;    /* CREATE INDEX statement or NULL */
+  int flags;
+  int64_t executions;
+  int64_t fullscan_steps;
+  int64_t sorts;
+  int64_t autoindexes;
+  int64_t vm_steps;
+  UT_hash_handle hh;
+};
+
+// Number of connections with diagnostics on, so the hooks cost a single
+// load when nobody uses them.
+static int g_enabled_count = 0;
+
+// Distinct statements kept per connection. SQL built with inlined values
+// never repeats, the least recently run plan makes room for a new one.
+static const unsigned int MAX_PLANS = 256;
+
+static bool is_ident_char(char c) {
+  return isalnum((unsigned char) c) || c == '_';
+}
+
+static bool starts_with_word(const char *s, const char *word) {
+  size_t len = strlen(word);
+  return strncasecmp(s, word, len) == 0 && !is_ident_char(s[len]);
+}
+
+#define MAX_INDEX_COLUMNS 16
+
+struct index_columns_t {
+  const char *names[MAX_INDEX_COLUMNS];
+  size_t lens[MAX_INDEX_COLUMNS];
+  int count;
+};
+
+static void add_index_column(struct index_columns_t *cols, const char *name,
+                             size_t len) {
+  for (int i = 0; i < cols->count; i++) {
+    if (cols->lens[i] == len && strncasecmp(cols->names[i], name, len) == 0)
+      return;
+  }
+
+  if (cols->count < MAX_INDEX_COLUMNS) {
+    cols->names[cols->count] = name;
+    cols->lens[cols->count] = len;
+    cols->count++;
+  }
+}
+
+static char *format_index(const char *table, size_t table_len,
+                          const struct index_columns_t *cols) {
+  if (cols->count == 0)
+    return NULL;
+
+  string index_name = string_new();
+  string column_list = string_new();
+  string_append(index_name, "idx_");
+  char buf[128];
+  for (int i = -1; i < cols->count; i++) {
+    const char *name = i < 0 ? table : cols->names[i];
+    size_t len = i < 0 ? table_len : cols->lens[i];
+    if (len >= sizeof(buf))
+      len = sizeof(buf) - 1;
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+    if (i >= 0) {
+      string_append(index_name, "_");
+      if (i > 0)
+        string_append(column_list, ", ");
+      string_append(column_list, buf);
+    }
+
+    string_append(index_name, buf);
+  }
+
+  if (table_len >= sizeof(buf))
+    table_len = sizeof(buf) - 1;
+  memcpy(buf, table, table_len);
+  buf[table_len] = '\0';
+  string stmt = string_printf("CREATE INDEX %s ON %s(%s)",
+                              string_get_data(index_name), buf,
+                              string_get_data(column_list));
+  char *suggestion = (char *) db_tag(db_strdup(string_get_data(stmt)),
+                                     MEM_CACHE);
+  string_delete(stmt);
+  string_delete(column_list);
+  string_delete(index_name);
+  return suggestion;
+}
+
+// Rank the columns of `table` referenced by `sql`: equality predicates
+// first, then ranges, then ORDER BY, then the rest so the index covers the
+// query. This is a heuristic on the SQL text, not a full parse.
+static char *suggest_index(sqlite3 *db, const char *sql, const char *table,
+                           size_t table_len) {
+  char name[128];
+  if (table_len == 0 || table_len >= sizeof(name))
+    return NULL;
+
+  memcpy(name, table, table_len);
+  name[table_len] = '\0';
+  string pragma = string_printf("PRAGMA table_info(%s)", name);
+  char **result = NULL;
+  int rows = 0, cols = 0;
+  int rc = sqlite3_get_table(db, string_get_data(pragma), &result, &rows,
+                             &cols, NULL);
+  string_delete(pragma);
+  if (rc != SQLITE_OK || rows == 0) {
+    sqlite3_free_table(result);
+    return NULL;
+  }
+
+  struct index_columns_t index = {{NULL}, {0}, 0};
+  for (int pass = 0; pass < 4; pass++) {
+    // Without a filter or sort column an index would not help.
+    if (pass == 3 && index.count == 0)
+      break;
+
+    bool in_order_by = false;
+    const char *p = sql;
+    while (*p) {
+      if (!is_ident_char(*p) || isdigit((unsigned char) *p)) {
+        p++;
+        continue;
+      }
+
+      if (starts_with_word(p, "ORDER")) {
+        in_order_by = true;
+      } else if (starts_with_word(p, "LIMIT")) {
+        in_order_by = false;
+      }
+
+      const char *word = p;
+      while (is_ident_char(*p))
+        p++;
+      size_t len = (size_t) (p - word);
+      if (*p == '.')
+        continue;  // table qualifier, the column follows
+
+      // Column names are the second field of every table_info row.
+      bool is_column = false;
+      for (int i = 1; i <= rows; i++) {
+        const char *col = result[i * cols + 1];
+        if (strlen(col) == len && strncasecmp(col, word, len) == 0) {
+          is_column = true;
+          break;
+        }
+      }
+
+      if (!is_column)
+        continue;
+
+      const char *op = p;
+      while (*op == ' ')
+        op++;
+      bool eq = op[0] == '=' || starts_with_word(op, "IN") ||
+                starts_with_word(op, "IS");
+      bool range = op[0] == '<' || op[0] == '>' ||
+                   starts_with_word(op, "BETWEEN");
+      if ((pass == 0 && eq && !in_order_by) ||
+          (pass == 1 && range && !in_order_by) ||
+          (pass == 2 && in_order_by) || pass == 3) {
+        add_index_column(&index, word, len);
+      }
+    }
+  }
+
+  char *suggestion = format_index(table, table_len, &index);
+  sqlite3_free_table(result);
+  return suggestion;
+}
+
+// "SEARCH t USING AUTOMATIC COVERING INDEX (a=? AND b>?)" names the index
+// SQLite keeps rebuilding, suggest making it permanent.
+static char *suggest_from_automatic(const char *detail) {
+  if (strncmp(detail, "SEARCH ", 7) != 0)
+    return NULL;
+
+  const char *table = detail + 7;
+  if (strncmp(table, "TABLE ", 6) == 0)
+    table += 6;
+  size_t table_len = 0;
+  while (is_ident_char(table[table_len]))
+    table_len++;
+
+  const char *p = strchr(detail, '(');
+  struct index_columns_t index = {{NULL}, {0}, 0};
+  while (p && *p && *p != ')') {
+    if (!is_ident_char(*p)) {
+      p++;
+      continue;
+    }
+
+    const char *word = p;
+    while (is_ident_char(*p))
+      p++;
+    if (!starts_with_word(word, "AND"))
+      add_index_column(&index, word, (size_t) (p - word));
+  }
+
+  return format_index(table, table_len, &index);
+}
+
+static void explain(sqlite3 *db, struct plan_t *plan) {
+  string sql = string_new();
+  string_append(sql, "EXPLAIN QUERY PLAN ");
+  string_append(sql, plan->key);
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, string_get_data(sql), -1, &stmt,
+                         NULL) != SQLITE_OK) {
+    string_delete(sql);
+    return;
+  }
+
+  string details = string_new();
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *detail = (const char *) sqlite3_column_text(stmt, 3);
+    if (!detail)
+      continue;
+
+    string_append(details, detail);
+    string_append(details, "\n");
+    if (strstr(detail, "USE TEMP B-TREE"))
+      plan->flags |= PLAN_TEMP_BTREE;
+    if (strstr(detail, "AUTOMATIC")) {
+      plan->flags |= PLAN_AUTO_INDEX;
+      if (!plan->suggestion)
+        plan->suggestion = suggest_from_automatic(detail);
+    }
+
+    // "SCAN t" or "SCAN TABLE t" on older versions, but not a covering
+    // index scan, a subquery or a constant row.
+    if (strncmp(detail, "SCAN ", 5) == 0 && !strstr(detail, " INDEX ") &&
+        detail[5] != '(' && strncmp(detail + 5, "CONSTANT", 8) != 0) {
+      plan->flags |= PLAN_FULL_SCAN;
+      if (!plan->suggestion) {
+        const char *table = detail + 5;
+        if (strncmp(table, "TABLE ", 6) == 0)
+          table += 6;
+        size_t len = 0;
+        while (is_ident_char(table[len]))
+          len++;
+        plan->suggestion = suggest_index(db, plan->key, table, len);
+      }
+    }
+  }
+
+  plan->plan = (char *) db_tag(db_strdup(string_get_data(details)),
+                               MEM_CACHE);
+  string_delete(details);
+  sqlite3_finalize(stmt);
+  string_delete(sql);
+}
+
+static void free_plan(struct plan_t *plan) {
+  if (!plan)
+    return;
+
+  db_free(plan->key);
+  db_free(plan->plan);
+  db_free(plan->suggestion);
+  db_free(plan);
+}
+
+// Add the counters of one run and make `plan` the most recently used, the
+// hash iterates in insertion order. Called under conn->lock.
+static void count_run(connection_t *conn, struct plan_t *plan, int fullscan,
+                      int sorts, int autoindex, int vm_steps) {
+  HASH_DEL(conn->plans, plan);
+  HASH_ADD_STR(conn->plans, key, plan);
+  plan->executions++;
+  plan->fullscan_steps += fullscan;
+  plan->sorts += sorts;
+  plan->autoindexes += autoindex;
+  plan->vm_steps += vm_steps;
+}
+
+void diagnostics_observe(sqlite3 *db, sqlite3_stmt *stmt) {
+  if (__atomic_load_n(&g_enabled_count, __ATOMIC_RELAXED) == 0 || !stmt)
+    return;
+
+  connection_t *conn = connection_find(db);
+  if (!conn || !conn->diagnostics)
+    return;
+
+  const char *sql = sqlite3_sql(stmt);
+  if (!sql || strncasecmp(sql, "EXPLAIN", 7) == 0)
+    return;
+
+  int fullscan = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+  int sorts = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+  int autoindex = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+  int vm_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+
+  pthread_mutex_lock(&conn->lock);
+  struct plan_t *plan = NULL;
+  HASH_FIND_STR(conn->plans, sql, plan);
+  if (plan)
+    count_run(conn, plan, fullscan, sorts, autoindex, vm_steps);
+  pthread_mutex_unlock(&conn->lock);
+  if (plan)
+    return;
+
+  // Explain outside the lock, it runs a statement of its own.
+  struct plan_t *fresh =
+      (struct plan_t *) db_tag(db_calloc(1, sizeof(struct plan_t)),
+                               MEM_CACHE);
+  fresh->key = (char *) db_tag(db_strdup(sql), MEM_CACHE);
+  explain(db, fresh);
+
+  struct plan_t *evicted = NULL;
+  pthread_mutex_lock(&conn->lock);
+  HASH_FIND_STR(conn->plans, sql, plan);
+  if (!plan) {
+    // The head of the hash is the oldest entry.
+    if (HASH_COUNT(conn->plans) >= MAX_PLANS) {
+      evicted = conn->plans;
+      HASH_DEL(conn->plans, evicted);
+    }
+
+    HASH_ADD_STR(conn->plans, key, fresh);
+    plan = fresh;
+    fresh = NULL;
+  }
+
+  count_run(conn, plan, fullscan, sorts, autoindex, vm_steps);
+  pthread_mutex_unlock(&conn->lock);
+  free_plan(fresh);
+  free_plan(evicted);
+}
+
+static void plans_release(struct plan_t *plans) {
+  struct plan_t *cur, *tmp;
+  HASH_ITER(hh, plans, cur, tmp) {
+    HASH_DEL(plans, cur);
+    free_plan(cur);
+  }
+}
+
+void db_diagnostics_enable(sqlite3 *db, bool enable) {
+  connection_t *conn = connection_get(db);
+  if (!conn)
+    return;
+
+  pthread_mutex_lock(&conn->lock);
+  if (conn->diagnostics != enable) {
+    conn->diagnostics = enable;
+    __atomic_fetch_add(&g_enabled_count, enable ? 1 : -1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&conn->lock);
+}
+
+void diagnostics_release(connection_t *conn) {
+  if (conn->diagnostics)
+    __atomic_fetch_sub(&g_enabled_count, 1, __ATOMIC_RELAXED);
+  plans_release(conn->plans);
+  conn->plans = NULL;
+}
+
+void diagnostics_trim(connection_t *conn) {
+  pthread_mutex_lock(&conn->lock);
+  struct plan_t *plans = conn->plans;
+  conn->plans = NULL;
+  pthread_mutex_unlock(&conn->lock);
+  plans_release(plans);
+}
+
+void db_diagnostics_reset(sqlite3 *db) {
+  connection_t *conn = connection_find(db);
+  if (conn)
+    diagnostics_trim(conn);
+}
+
+int db_diagnostics_plan_flags(sqlite3 *db, const char *sql) {
+  connection_t *conn = connection_find(db);
+  if (!conn)
+    return -1;
+
+  pthread_mutex_lock(&conn->lock);
+  struct plan_t *plan = NULL;
+  HASH_FIND_STR(conn->plans, sql, plan);
+  int flags = plan ? plan->flags : -1;
+  pthread_mutex_unlock(&conn->lock);
+  return flags;
+}
+
+static int64_t cost_of(const struct plan_t *plan) {
+  return plan->fullscan_steps * 4 + plan->vm_steps + plan->sorts * 100 +
+         plan->autoindexes * 100;
+}
+
+void db_diagnostics_report(sqlite3 *db, FILE *out, int max) {
+  connection_t *conn = connection_find(db);
+  if (!conn || !out || max <= 0)
+    return;
+
+  pthread_mutex_lock(&conn->lock);
+  size_t count = HASH_COUNT(conn->plans);
+  struct plan_t **sorted =
+      (struct plan_t **) db_calloc(count ? count : 1, sizeof(struct plan_t *));
+  size_t n = 0;
+  struct plan_t *cur, *tmp;
+  HASH_ITER(hh, conn->plans, cur, tmp) {
+    // Insertion sort by cost, the plan cache is small.
+    size_t i = n++;
+    while (i > 0 && cost_of(sorted[i - 1]) < cost_of(cur)) {
+      sorted[i] = sorted[i - 1];
+      i--;
+    }
+    sorted[i] = cur;
+  }
+
+  for (size_t i = 0; i < n && i < (size_t) max; i++) {
+    struct plan_t *plan = sorted[i];
+    fprintf(out, "#%zu %s\n", i + 1, plan->key);
+    fprintf(out, "  executions: %lld, fullscan steps: %lld, sorts: %lld, "
+                 "autoindex: %lld, vm steps: %lld\n",
+            (long long) plan->executions, (long long) plan->fullscan_steps,
+            (long long) plan->sorts, (long long) plan->autoindexes,
+            (long long) plan->vm_steps);
+    if (plan->flags & PLAN_FULL_SCAN)
+      fprintf(out, "  warning: full table scan\n");
+    if (plan->flags & PLAN_TEMP_BTREE)
+      fprintf(out, "  warning: temp b-tree sort\n");
+    if (plan->flags & PLAN_AUTO_INDEX)
+      fprintf(out, "  warning: automatic index\n");
+    if (plan->plan) {
+      fprintf(out, "  plan:\n");
+      const char *line = plan->plan;
+      const char *end;
+      while ((end = strchr(line, '\n')) != NULL) {
+        fprintf(out, "    %.*s\n", (int) (end - line), line);
+        line = end + 1;
+      }
+    }
+    if (plan->suggestion)
+      fprintf(out, "  suggestion: %s\n", plan->suggestion);
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+  db_free(sorted);
+}
@@ -0,0 +1,217 @@
+#include "fts.h"
+
+#include <stdio.h>
+
+#include "connection.h"
+#include "query_builder.h"
+#include "scope.h"
+
+// Append `columns`, each prefixed by `prefix` ("new.", "old." or "").
+static void append_columns(string sql, db_column columns, const char *prefix) {
+  for (size_t i = 0; i < columns_size(columns); i++) {
+    if (i > 0) {
+      string_append(sql, ", ");
+    }
+
+    string_append(sql, prefix);
+    string_append(sql, columns_get_name(columns, i));
+  }
+}
+
+static bool fts_exists(sqlite3 *db, const char *table) {
+  sqlite3_stmt *stmt = NULL;
+  bool exists = false;
+  if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = "
+                             "'table' AND name = ?1 || '_fts'", -1, &stmt,
+                         NULL) == SQLITE_OK) {
+    sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+    exists = sqlite3_step(stmt) == SQLITE_ROW;
+  }
+
+  sqlite3_finalize(stmt);
+  return exists;
+}
+
+static string build_fts_create(const char *table, db_column columns) {
+  string sql = string_printf("CREATE VIRTUAL TABLE %s_fts USING fts5(",
+                             table);
+  append_columns(sql, columns, "");
+  string_append(sql, ", content=");
+  string_append(sql, table);
+  string_append(sql, ");\n");
+
+  // AFTER INSERT
+  string line = string_printf("CREATE TRIGGER %s_fts_ai AFTER INSERT ON %s "
+                              "BEGIN INSERT INTO %s_fts(rowid, ",
+                              table, table, table);
+  string_append(sql, string_get_data(line));
+  string_delete(line);
+  append_columns(sql, columns, "");
+  string_append(sql, ") VALUES (new.rowid, ");
+  append_columns(sql, columns, "new.");
+  string_append(sql, "); END;\n");
+
+  // AFTER DELETE, an external content index is told what to remove.
+  line = string_printf("CREATE TRIGGER %s_fts_ad AFTER DELETE ON %s "
+                       "BEGIN INSERT INTO %s_fts(%s_fts, rowid, ",
+                       table, table, table, table);
+  string_append(sql, string_get_data(line));
+  string_delete(line);
+  append_columns(sql, columns, "");
+  string_append(sql, ") VALUES ('delete', old.rowid, ");
+  append_columns(sql, columns, "old.");
+  string_append(sql, "); END;\n");
+
+  // AFTER UPDATE, only when an indexed column changes.
+  line = string_printf("CREATE TRIGGER %s_fts_au AFTER UPDATE OF ", table);
+  string_append(sql, string_get_data(line));
+  string_delete(line);
+  append_columns(sql, columns, "");
+  line = string_printf(" ON %s BEGIN INSERT INTO %s_fts(%s_fts, rowid, ",
+                       table, table, table);
+  string_append(sql, string_get_data(line));
+  string_delete(line);
+  append_columns(sql, columns, "");
+  string_append(sql, ") VALUES ('delete', old.rowid, ");
+  append_columns(sql, columns, "old.");
+  line = string_printf("); INSERT INTO %s_fts(rowid, ", table);
+  string_append(sql, string_get_data(line));
+  string_delete(line);
+  append_columns(sql, columns, "");
+  string_append(sql, ") VALUES (new.rowid, ");
+  append_columns(sql, columns, "new.");
+  string_append(sql, "); END;\n");
+
+  line = string_printf("INSERT INTO %s_fts(%s_fts) VALUES ('rebuild');",
+                       table, table);
+  string_append(sql, string_get_data(line));
+  string_delete(line);
+  return sql;
+}
+
+// Run `sql` in one write scope.
+static int exec_in_transaction(sqlite3 *db, const char *sql) {
+  int rc = db_write_begin(db);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  char *errmsg = NULL;
+  rc = deadline_exec(db, sql, &errmsg);
+  if (rc != SQLITE_OK) {
+    printf("fts error(%d): %s\n", rc, errmsg);
+    sqlite3_free(errmsg);
+    db_write_rollback(db);
+    return rc;
+  }
+
+  return db_write_commit(db);
+}
+
+int db_fts_create(sqlite3 *db, const char *table, db_column columns) {
+  if (!db || !table || columns_size(columns) == 0)
+    return SQLITE_MISUSE;
+
+  if (fts_exists(db, table))
+    return SQLITE_OK;
+
+  string sql = build_fts_create(table, columns);
+  int rc = exec_in_transaction(db, string_get_data(sql));
+  string_delete(sql);
+  return rc;
+}
+
+int db_fts_drop(sqlite3 *db, const char *table) {
+  if (!db || !table)
+    return SQLITE_MISUSE;
+
+  string sql = string_printf("DROP TRIGGER IF EXISTS %s_fts_ai;"
+                             "DROP TRIGGER IF EXISTS %s_fts_ad;"
+                             "DROP TRIGGER IF EXISTS %s_fts_au;"
+                             "DROP TABLE IF EXISTS %s_fts;",
+                             table, table, table, table);
+  int rc = exec_in_transaction(db, string_get_data(sql));
+  string_delete(sql);
+  return rc;
+}
+
+static int fts_command(sqlite3 *db, const char *table, const char *command) {
+  if (!db || !table)
+    return SQLITE_MISUSE;
+
+  string sql = string_printf("INSERT INTO %s_fts(%s_fts) VALUES ('%s')",
+                             table, table, command);
+  int rc = exec_in_transaction(db, string_get_data(sql));
+  string_delete(sql);
+  return rc;
+}
+
+int db_fts_rebuild(sqlite3 *db, const char *table) {
+  return fts_command(db, table, "rebuild");
+}
+
+int db_fts_optimize(sqlite3 *db, const char *table) {
+  return fts_command(db, table, "optimize");
+}
+
+// The ranking and LIMIT run inside the FTS5 query, which only keeps the
+// best `limit` hits, and the rows are then fetched by rowid.
+static string build_search(const char *table, db_column columns, int limit) {
+  string sql = string_new();
+  string_append(sql, "SELECT ");
+  if (columns_size(columns) == 0) {
+    string_append(sql, table);
+    string_append(sql, ".*");
+  } else {
+    string prefix = string_printf("%s.", table);
+    append_columns(sql, columns, string_get_data(prefix));
+    string_delete(prefix);
+  }
+
+  string line = string_printf(" FROM (SELECT rowid AS hit_id, rank AS "
+                              "hit_rank FROM %s_fts WHERE %s_fts MATCH ?1 "
+                              "ORDER BY rank", table, table);
+  string_append(sql, string_get_data(line));
+  string_delete(line);
+  if (limit > 0)
+    string_append(sql, " LIMIT ?2");
+  line = string_printf(") JOIN %s ON %s.rowid = hit_id ORDER BY hit_rank",
+                       table, table);
+  string_append(sql, string_get_data(line));
+  string_delete(line);
+  return sql;
+}
+
+db_cursor db_search(sqlite3 *db, const char *table, const char *match_expr,
+                    db_column columns, int limit) {
+  if (!db || !table || !match_expr)
+    return NULL;
+
+  string sql = build_search(table, columns, limit);
+  sqlite3_stmt *stmt = NULL;
+  int rc = sqlite3_prepare_v2(db, string_get_data(sql), -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    printf("failed to prepare sql: %s, error(%d): %s\n",
+           string_get_data(sql), rc, sqlite3_errmsg(db));
+    string_delete(sql);
+    return NULL;
+  }
+
+  string_delete(sql);
+  sqlite3_bind_text(stmt, 1, match_expr, -1, SQLITE_TRANSIENT);
+  if (limit > 0)
+    sqlite3_bind_int(stmt, 2, limit);
+
+  step_deadline_t budget = {NULL, 0};
+  rc = deadline_step(db, stmt, &budget);
+  if (rc != SQLITE_ROW) {
+    if (rc != SQLITE_DONE)
+      printf("search error(%d): %s\n", rc, sqlite3_errmsg(db));
+    diagnostics_observe(db, stmt);
+    sqlite3_finalize(stmt);
+    return NULL;
+  }
+
+  db_cursor cursor = cursor_new(db, stmt);
+  cursor_set_deadline(cursor, budget);
+  return cursor;
+}
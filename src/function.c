@@ -0,0 +1,335 @@
+#include "function.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "allocator.h"
+#include "connection.h"
+
+struct function_t {
+  sqlite3 *db;
+  char *name;
+  int nargs;
+  size_t state_size;
+  db_func_callback func;     /* Scalar body or aggregate step */
+  db_func_callback final;
+  db_func_callback value;
+  db_func_callback inverse;
+  void *user_data;
+
+  int64_t calls;
+  int64_t total_us;
+  int64_t max_us;
+
+  struct function_t *next;
+};
+
+struct func_call_t {
+  sqlite3_context *ctx;
+  int argc;
+  sqlite3_value **argv;
+  struct function_t *function;
+};
+
+static int64_t get_time_in_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void record_call(struct function_t *function, int64_t elapsed) {
+  __atomic_fetch_add(&function->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&function->total_us, elapsed, __ATOMIC_RELAXED);
+  int64_t max = __atomic_load_n(&function->max_us, __ATOMIC_RELAXED);
+  while (elapsed > max &&
+         !__atomic_compare_exchange_n(&function->max_us, &max, elapsed, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static void invoke(db_func_callback callback, sqlite3_context *ctx,
+                   int argc, sqlite3_value **argv) {
+  struct func_call_t call;
+  call.ctx = ctx;
+  call.argc = argc;
+  call.argv = argv;
+  call.function = (struct function_t *) sqlite3_user_data(ctx);
+
+  int64_t start = get_time_in_us();
+  callback(&call);
+  record_call(call.function, get_time_in_us() - start);
+}
+
+static void x_func(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+  struct function_t *function = (struct function_t *) sqlite3_user_data(ctx);
+  invoke(function->func, ctx, argc, argv);
+}
+
+static void x_final(sqlite3_context *ctx) {
+  struct function_t *function = (struct function_t *) sqlite3_user_data(ctx);
+  invoke(function->final, ctx, 0, NULL);
+}
+
+static void x_value(sqlite3_context *ctx) {
+  struct function_t *function = (struct function_t *) sqlite3_user_data(ctx);
+  invoke(function->value, ctx, 0, NULL);
+}
+
+static void x_inverse(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+  struct function_t *function = (struct function_t *) sqlite3_user_data(ctx);
+  invoke(function->inverse, ctx, argc, argv);
+}
+
+static void function_delete(struct function_t *function) {
+  db_free(function->name);
+  db_free(function);
+}
+
+// Called by SQLite when the function is replaced, dropped or the handle is
+// closed.
+static void x_destroy(void *data) {
+  struct function_t *function = (struct function_t *) data;
+  connection_t *conn = connection_find(function->db);
+  if (conn) {
+    pthread_mutex_lock(&conn->lock);
+    struct function_t **cur = &conn->functions;
+    while (*cur && *cur != function) {
+      cur = &(*cur)->next;
+    }
+
+    if (*cur)
+      *cur = function->next;
+    pthread_mutex_unlock(&conn->lock);
+  }
+
+  function_delete(function);
+}
+
+static int to_sqlite_flags(int flags) {
+  int text_rep = SQLITE_UTF8;
+  if (flags & FUNC_DETERMINISTIC)
+    text_rep |= SQLITE_DETERMINISTIC;
+  if (flags & FUNC_INNOCUOUS)
+    text_rep |= SQLITE_INNOCUOUS;
+  if (flags & FUNC_DIRECTONLY)
+    text_rep |= SQLITE_DIRECTONLY;
+  return text_rep;
+}
+
+static struct function_t *function_new(sqlite3 *db, const char *name,
+                                       int nargs, size_t state_size,
+                                       void *user_data) {
+  struct function_t *function =
+      (struct function_t *) db_calloc(1, sizeof(struct function_t));
+  function->db = db;
+  function->name = db_strdup(name);
+  function->nargs = nargs;
+  function->state_size = state_size;
+  function->user_data = user_data;
+  return function;
+}
+
+static int register_function(struct function_t *function, int flags) {
+  connection_t *conn = connection_get(function->db);
+  pthread_mutex_lock(&conn->lock);
+  function->next = conn->functions;
+  conn->functions = function;
+  pthread_mutex_unlock(&conn->lock);
+
+  int rc;
+  if (function->value) {
+    rc = sqlite3_create_window_function(
+        function->db, function->name, function->nargs, to_sqlite_flags(flags),
+        function, x_func, x_final, x_value, x_inverse, x_destroy);
+  } else if (function->final) {
+    rc = sqlite3_create_function_v2(
+        function->db, function->name, function->nargs, to_sqlite_flags(flags),
+        function, NULL, x_func, x_final, x_destroy);
+  } else {
+    rc = sqlite3_create_function_v2(
+        function->db, function->name, function->nargs, to_sqlite_flags(flags),
+        function, x_func, NULL, NULL, x_destroy);
+  }
+
+  // SQLite calls x_destroy itself when registration fails.
+  if (rc != SQLITE_OK) {
+    printf("failed to create function %s: %s\n",
+           function->name, sqlite3_errmsg(function->db));
+  }
+
+  return rc;
+}
+
+int db_create_scalar_function(sqlite3 *db, const char *name, int nargs,
+                              int flags, db_func_callback func,
+                              void *user_data) {
+  if (!db || !name || !func)
+    return SQLITE_MISUSE;
+
+  struct function_t *function = function_new(db, name, nargs, 0, user_data);
+  function->func = func;
+  return register_function(function, flags);
+}
+
+int db_create_aggregate_function(sqlite3 *db, const char *name, int nargs,
+                                 int flags, size_t state_size,
+                                 db_func_callback step,
+                                 db_func_callback final,
+                                 void *user_data) {
+  if (!db || !name || !step || !final)
+    return SQLITE_MISUSE;
+
+  struct function_t *function =
+      function_new(db, name, nargs, state_size, user_data);
+  function->func = step;
+  function->final = final;
+  return register_function(function, flags);
+}
+
+int db_create_window_function(sqlite3 *db, const char *name, int nargs,
+                              int flags, size_t state_size,
+                              db_func_callback step, db_func_callback final,
+                              db_func_callback value,
+                              db_func_callback inverse, void *user_data) {
+  if (!db || !name || !step || !final || !value || !inverse)
+    return SQLITE_MISUSE;
+
+  struct function_t *function =
+      function_new(db, name, nargs, state_size, user_data);
+  function->func = step;
+  function->final = final;
+  function->value = value;
+  function->inverse = inverse;
+  return register_function(function, flags);
+}
+
+int db_drop_function(sqlite3 *db, const char *name, int nargs) {
+  // Registering a NULL implementation deletes the function and runs the
+  // destructor of the one it replaces.
+  return sqlite3_create_function_v2(db, name, nargs, SQLITE_UTF8, NULL,
+                                    NULL, NULL, NULL, NULL);
+}
+
+bool db_function_stats(sqlite3 *db, const char *name, db_func_stats *stats) {
+  connection_t *conn = connection_find(db);
+  if (!conn || !stats)
+    return false;
+
+  bool found = false;
+  memset(stats, 0, sizeof(db_func_stats));
+  pthread_mutex_lock(&conn->lock);
+  for (struct function_t *cur = conn->functions; cur; cur = cur->next) {
+    if (sqlite3_stricmp(cur->name, name) != 0)
+      continue;
+
+    found = true;
+    stats->calls += __atomic_load_n(&cur->calls, __ATOMIC_RELAXED);
+    stats->total_us += __atomic_load_n(&cur->total_us, __ATOMIC_RELAXED);
+    int64_t max = __atomic_load_n(&cur->max_us, __ATOMIC_RELAXED);
+    if (max > stats->max_us)
+      stats->max_us = max;
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+  return found;
+}
+
+void db_function_reset_stats(sqlite3 *db) {
+  connection_t *conn = connection_find(db);
+  if (!conn)
+    return;
+
+  pthread_mutex_lock(&conn->lock);
+  for (struct function_t *cur = conn->functions; cur; cur = cur->next) {
+    __atomic_store_n(&cur->calls, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&cur->total_us, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&cur->max_us, 0, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+}
+
+int func_arg_count(db_func_call call) {
+  return call->argc;
+}
+
+value_type func_arg_type(db_func_call call, int i) {
+  if (i < 0 || i >= call->argc)
+    return VALUE_NULL;
+
+  switch (sqlite3_value_type(call->argv[i])) {
+    case SQLITE_INTEGER:return VALUE_INT;
+    case SQLITE_FLOAT:return VALUE_DOUBLE;
+    case SQLITE_TEXT:return VALUE_TEXT;
+    case SQLITE_BLOB:return VALUE_BLOB;
+    default:return VALUE_NULL;
+  }
+}
+
+int func_arg_int(db_func_call call, int i) {
+  return i >= 0 && i < call->argc ? sqlite3_value_int(call->argv[i]) : 0;
+}
+
+int64_t func_arg_int64(db_func_call call, int i) {
+  return i >= 0 && i < call->argc ? sqlite3_value_int64(call->argv[i]) : 0;
+}
+
+double func_arg_double(db_func_call call, int i) {
+  return i >= 0 && i < call->argc ? sqlite3_value_double(call->argv[i]) : 0;
+}
+
+const char *func_arg_text(db_func_call call, int i) {
+  if (i < 0 || i >= call->argc)
+    return NULL;
+
+  return (const char *) sqlite3_value_text(call->argv[i]);
+}
+
+const void *func_arg_blob(db_func_call call, int i) {
+  return i >= 0 && i < call->argc ? sqlite3_value_blob(call->argv[i]) : NULL;
+}
+
+int func_arg_bytes(db_func_call call, int i) {
+  return i >= 0 && i < call->argc ? sqlite3_value_bytes(call->argv[i]) : 0;
+}
+
+void *func_user_data(db_func_call call) {
+  return call->function->user_data;
+}
+
+void *func_state(db_func_call call) {
+  if (call->function->state_size == 0)
+    return NULL;
+
+  return sqlite3_aggregate_context(call->ctx,
+                                   (int) call->function->state_size);
+}
+
+void func_result_null(db_func_call call) {
+  sqlite3_result_null(call->ctx);
+}
+
+void func_result_int(db_func_call call, int i) {
+  sqlite3_result_int(call->ctx, i);
+}
+
+void func_result_int64(db_func_call call, int64_t i) {
+  sqlite3_result_int64(call->ctx, i);
+}
+
+void func_result_double(db_func_call call, double d) {
+  sqlite3_result_double(call->ctx, d);
+}
+
+void func_result_text(db_func_call call, const char *s, int len) {
+  sqlite3_result_text(call->ctx, s, len, SQLITE_TRANSIENT);
+}
+
+void func_result_blob(db_func_call call, const void *data, int len) {
+  sqlite3_result_blob(call->ctx, data, len, SQLITE_TRANSIENT);
+}
+
+void func_result_error(db_func_call call, const char *msg) {
+  sqlite3_result_error(call->ctx, msg, -1);
+}
@@ -0,0 +1,255 @@
+#include "kv.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "connection.h"
+#include "query_builder.h"
+#include "scope.h"
+#include "statement.h"
+
+// Prefix bounds up to this size are built on the stack.
+#define BOUND_BUFFER_SIZE 256
+
+struct kv_t {
+  sqlite3 *db;
+  pthread_mutex_t lock;     /* The statements are shared by every caller */
+  db_stmt get;
+  db_stmt put;
+  db_stmt del;
+  db_stmt scan_range;       /* key >= ?1 AND key < ?2 */
+  db_stmt scan_from;        /* key >= ?1, for prefixes with no upper bound */
+};
+
+static db_stmt prepare_kv(sqlite3 *db, const char *fmt, const char *name) {
+  string sql = string_printf(fmt, name);
+  db_stmt stmt = db_prepare(db, string_get_data(sql));
+  string_delete(sql);
+  return stmt;
+}
+
+db_kv kv_open(sqlite3 *db, const char *name) {
+  if (!db || !name)
+    return NULL;
+
+  string sql = string_printf("CREATE TABLE IF NOT EXISTS %s("
+                             "key TEXT PRIMARY KEY NOT NULL, value BLOB) "
+                             "WITHOUT ROWID", name);
+  int rc = busy_exec(db, string_get_data(sql), NULL);
+  if (rc != SQLITE_OK)
+    printf("failed to create %s: %s\n", name, sqlite3_errmsg(db));
+  string_delete(sql);
+  if (rc != SQLITE_OK)
+    return NULL;
+
+  db_kv kv = (db_kv) db_tag(db_calloc(1, sizeof(struct kv_t)), MEM_CACHE);
+  kv->db = db;
+  pthread_mutex_init(&kv->lock, NULL);
+  kv->get = prepare_kv(db, "SELECT value FROM %s WHERE key = ?1", name);
+  kv->put = prepare_kv(db, "INSERT OR REPLACE INTO %s(key, value) "
+                           "VALUES (?1, ?2)", name);
+  kv->del = prepare_kv(db, "DELETE FROM %s WHERE key = ?1", name);
+  kv->scan_range = prepare_kv(db, "SELECT key, value FROM %s WHERE key >= ?1 "
+                                  "AND key < ?2 ORDER BY key", name);
+  kv->scan_from = prepare_kv(db, "SELECT key, value FROM %s WHERE key >= ?1 "
+                                 "ORDER BY key", name);
+  if (!kv->get || !kv->put || !kv->del || !kv->scan_range ||
+      !kv->scan_from) {
+    kv_close(kv);
+    return NULL;
+  }
+
+  return kv;
+}
+
+void kv_close(db_kv kv) {
+  if (!kv)
+    return;
+
+  db_stmt_finalize(kv->get);
+  db_stmt_finalize(kv->put);
+  db_stmt_finalize(kv->del);
+  db_stmt_finalize(kv->scan_range);
+  db_stmt_finalize(kv->scan_from);
+  pthread_mutex_destroy(&kv->lock);
+  db_free(kv);
+}
+
+static int put_locked(db_kv kv, const char *key, const void *value,
+                      size_t len) {
+  if (len > INT_MAX)
+    return SQLITE_TOOBIG;
+
+  db_stmt_bind_text(kv->put, 1, key, -1);
+  db_stmt_bind_blob(kv->put, 2, value, (int) len);
+  int rc = db_stmt_step(kv->put);
+  db_stmt_reset(kv->put);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+int kv_put(db_kv kv, const char *key, const void *value, size_t len) {
+  if (!kv || !key)
+    return SQLITE_MISUSE;
+
+  scope_enter(kv->db);
+  pthread_mutex_lock(&kv->lock);
+  int rc = put_locked(kv, key, value, len);
+  pthread_mutex_unlock(&kv->lock);
+  scope_leave(kv->db);
+  return rc;
+}
+
+int kv_put_batch(db_kv kv, const db_kv_pair *pairs, size_t count) {
+  if (!kv || (!pairs && count > 0))
+    return SQLITE_MISUSE;
+
+  int rc = db_write_begin(kv->db);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  pthread_mutex_lock(&kv->lock);
+  for (size_t i = 0; i < count && rc == SQLITE_OK; i++) {
+    rc = pairs[i].key
+         ? put_locked(kv, pairs[i].key, pairs[i].value, pairs[i].len)
+         : SQLITE_MISUSE;
+  }
+
+  pthread_mutex_unlock(&kv->lock);
+  if (rc != SQLITE_OK) {
+    db_write_rollback(kv->db);
+    return rc;
+  }
+
+  return db_write_commit(kv->db);
+}
+
+int kv_get(db_kv kv, const char *key, void *buf, size_t cap, size_t *len) {
+  if (!kv || !key || !len)
+    return SQLITE_MISUSE;
+
+  pthread_mutex_lock(&kv->lock);
+  db_stmt_bind_text(kv->get, 1, key, -1);
+  int rc = db_stmt_step(kv->get);
+  if (rc == SQLITE_ROW) {
+    sqlite3_stmt *stmt = db_stmt_handle(kv->get);
+    const void *value = sqlite3_column_blob(stmt, 0);
+    *len = (size_t) sqlite3_column_bytes(stmt, 0);
+    if (*len > cap) {
+      rc = SQLITE_TOOBIG;
+    } else {
+      if (*len > 0)
+        memcpy(buf, value, *len);
+      rc = SQLITE_OK;
+    }
+  } else if (rc == SQLITE_DONE) {
+    *len = 0;
+    rc = SQLITE_NOTFOUND;
+  }
+
+  db_stmt_reset(kv->get);
+  pthread_mutex_unlock(&kv->lock);
+  return rc;
+}
+
+int kv_delete(db_kv kv, const char *key) {
+  if (!kv || !key)
+    return SQLITE_MISUSE;
+
+  scope_enter(kv->db);
+  pthread_mutex_lock(&kv->lock);
+  db_stmt_bind_text(kv->del, 1, key, -1);
+  int rc = db_stmt_step(kv->del);
+  db_stmt_reset(kv->del);
+  pthread_mutex_unlock(&kv->lock);
+  scope_leave(kv->db);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+int kv_multi_get(db_kv kv, const char *const *keys, size_t count,
+                 kv_callback callback, void *arg) {
+  if (!kv || !callback || (!keys && count > 0))
+    return SQLITE_MISUSE;
+
+  // One read scope: every lookup sees the same data and the shared lock is
+  // taken once.
+  int rc = db_read_begin(kv->db);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  pthread_mutex_lock(&kv->lock);
+  sqlite3_stmt *stmt = db_stmt_handle(kv->get);
+  bool more = true;
+  for (size_t i = 0; i < count && more && rc == SQLITE_OK; i++) {
+    db_stmt_bind_text(kv->get, 1, keys[i], -1);
+    int step = db_stmt_step(kv->get);
+    if (step == SQLITE_ROW) {
+      more = callback(keys[i], sqlite3_column_blob(stmt, 0),
+                      (size_t) sqlite3_column_bytes(stmt, 0), arg);
+    } else if (step == SQLITE_DONE) {
+      more = callback(keys[i], NULL, 0, arg);
+    } else {
+      rc = step;
+    }
+
+    db_stmt_reset(kv->get);
+  }
+
+  pthread_mutex_unlock(&kv->lock);
+  int end = db_read_end(kv->db);
+  return rc != SQLITE_OK ? rc : end;
+}
+
+// The smallest key greater than every key starting with `prefix`, or false
+// when there is none.
+static bool prefix_upper_bound(char *bound, size_t *len) {
+  while (*len > 0 && (unsigned char) bound[*len - 1] == 0xff) {
+    (*len)--;
+  }
+
+  if (*len == 0)
+    return false;
+
+  bound[*len - 1]++;
+  return true;
+}
+
+int kv_scan_prefix(db_kv kv, const char *prefix, kv_callback callback,
+                   void *arg) {
+  if (!kv || !callback)
+    return SQLITE_MISUSE;
+
+  if (!prefix)
+    prefix = "";
+  size_t len = strlen(prefix);
+  char stack_bound[BOUND_BUFFER_SIZE];
+  char *bound = len < sizeof(stack_bound) ? stack_bound
+                                          : (char *) db_malloc(len + 1);
+  memcpy(bound, prefix, len + 1);
+  bool bounded = prefix_upper_bound(bound, &len);
+
+  pthread_mutex_lock(&kv->lock);
+  db_stmt scan = bounded ? kv->scan_range : kv->scan_from;
+  sqlite3_stmt *stmt = db_stmt_handle(scan);
+  db_stmt_bind_text(scan, 1, prefix, -1);
+  if (bounded)
+    db_stmt_bind_text(scan, 2, bound, (int) len);
+
+  int rc;
+  while ((rc = db_stmt_step(scan)) == SQLITE_ROW) {
+    if (!callback((const char *) sqlite3_column_text(stmt, 0),
+                  sqlite3_column_blob(stmt, 1),
+                  (size_t) sqlite3_column_bytes(stmt, 1), arg)) {
+      rc = SQLITE_DONE;
+      break;
+    }
+  }
+
+  db_stmt_reset(scan);
+  pthread_mutex_unlock(&kv->lock);
+  if (bound != stack_bound)
+    db_free(bound);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
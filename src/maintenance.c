@@ -0,0 +1,378 @@
+#include "maintenance.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "connection.h"
+#include "query_builder.h"
+
+static const int DEFAULT_CHECKPOINT_INTERVAL_MS = 1000;
+static const int64_t DEFAULT_WAL_SIZE_LIMIT = 64 * 1024 * 1024;
+static const int DEFAULT_OPTIMIZE_INTERVAL_MS = 60 * 60 * 1000;
+static const int DEFAULT_VACUUM_INTERVAL_MS = 60 * 1000;
+static const int DEFAULT_VACUUM_PAGES = 256;
+static const int DEFAULT_IDLE_MS = 1000;
+// RESTART and TRUNCATE hold off new writers while they wait for readers,
+// so they give up quickly and are retried on the next tick.
+static const int ESCALATION_BUSY_TIMEOUT_MS = 100;
+static const int WAL_FRAME_HEADER = 24;
+static const int DEFAULT_WAL_AUTOCHECKPOINT = 1000;
+static const int64_t NEVER = INT64_MAX;
+
+struct maintenance_t {
+  sqlite3 *db;              /* Connection being served */
+  sqlite3 *conn;            /* Own connection, only used by the thread */
+  const char *wal_path;
+  int64_t frame_size;
+  bool vacuum_enabled;      /* auto_vacuum is INCREMENTAL */
+  db_maintenance_options options;
+
+  pthread_mutex_t lock;     /* Guards the fields below */
+  pthread_cond_t wakeup;
+  pthread_t thread;
+  bool running;
+  bool stop;
+  bool urgent;              /* The WAL went over the limit */
+  db_maintenance_stats stats;
+
+  int64_t last_write_ms;    /* Last commit on `db`, atomic */
+};
+
+static int64_t get_time_in_ms() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t) (now.tv_sec * 1000 + now.tv_usec / 1000);
+}
+
+static int pragma_int(sqlite3 *db, const char *sql) {
+  sqlite3_stmt *stmt = NULL;
+  int value = -1;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW)
+    value = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  return value;
+}
+
+static void record(struct maintenance_t *m, db_job_stats *job, int64_t start,
+                   bool ok) {
+  int64_t elapsed = get_time_in_ms() - start;
+  pthread_mutex_lock(&m->lock);
+  job->runs++;
+  if (!ok)
+    job->failures++;
+  job->last_ms = elapsed;
+  job->total_ms += elapsed;
+  if (elapsed > job->max_ms)
+    job->max_ms = elapsed;
+  pthread_mutex_unlock(&m->lock);
+}
+
+// Runs on the committing thread, keep it cheap.
+static int wal_hook(void *arg, sqlite3 *db, const char *name, int pages) {
+  struct maintenance_t *m = (struct maintenance_t *) arg;
+  (void) db;
+  (void) name;
+  __atomic_store_n(&m->last_write_ms, get_time_in_ms(), __ATOMIC_RELAXED);
+  if (pages * m->frame_size > m->options.wal_size_limit) {
+    pthread_mutex_lock(&m->lock);
+    if (!m->urgent) {
+      m->urgent = true;
+      pthread_cond_signal(&m->wakeup);
+    }
+
+    pthread_mutex_unlock(&m->lock);
+  }
+
+  return SQLITE_OK;
+}
+
+static int64_t wal_file_size(struct maintenance_t *m) {
+  struct stat st;
+  return m->wal_path && stat(m->wal_path, &st) == 0 ? (int64_t) st.st_size : 0;
+}
+
+static void run_checkpoint(struct maintenance_t *m) {
+  int64_t start = get_time_in_ms();
+  int frames = 0;
+  int done = 0;
+  int escalations = 0;
+  // PASSIVE never waits: it copies what no reader still needs.
+  int rc = sqlite3_wal_checkpoint_v2(m->conn, NULL, SQLITE_CHECKPOINT_PASSIVE,
+                                     &frames, &done);
+  if (rc == SQLITE_OK && frames * m->frame_size > m->options.wal_size_limit) {
+    escalations++;
+    rc = sqlite3_wal_checkpoint_v2(m->conn, NULL, SQLITE_CHECKPOINT_RESTART,
+                                   &frames, &done);
+    // RESTART makes writers start over at the beginning of the WAL, but
+    // the file keeps its size.
+    if (rc == SQLITE_OK && wal_file_size(m) > m->options.wal_size_limit) {
+      escalations++;
+      rc = sqlite3_wal_checkpoint_v2(m->conn, NULL,
+                                     SQLITE_CHECKPOINT_TRUNCATE, &frames,
+                                     &done);
+    }
+  }
+
+  if (rc != SQLITE_OK && rc != SQLITE_BUSY)
+    printf("checkpoint failed(%d): %s\n", rc, sqlite3_errmsg(m->conn));
+  pthread_mutex_lock(&m->lock);
+  m->stats.escalations += escalations;
+  m->stats.wal_frames = frames;
+  pthread_mutex_unlock(&m->lock);
+  record(m, &m->stats.checkpoint, start, rc == SQLITE_OK);
+}
+
+static void run_optimize(struct maintenance_t *m) {
+  int64_t start = get_time_in_ms();
+  // This connection has run no queries for PRAGMA optimize to learn from,
+  // 0x10002 makes it consider every table.
+  int rc = sqlite3_exec(m->conn, "PRAGMA optimize=0x10002", NULL, NULL, NULL);
+  if (rc != SQLITE_OK)
+    printf("optimize failed(%d): %s\n", rc, sqlite3_errmsg(m->conn));
+  record(m, &m->stats.optimize, start, rc == SQLITE_OK);
+}
+
+static bool is_idle(struct maintenance_t *m) {
+  int64_t last = __atomic_load_n(&m->last_write_ms, __ATOMIC_RELAXED);
+  return get_time_in_ms() - last >= m->options.idle_ms &&
+         !__atomic_load_n(&m->stop, __ATOMIC_RELAXED);
+}
+
+// Free pages in bounded chunks, each its own short write transaction, and
+// back off as soon as `db` commits again.
+static bool run_vacuum(struct maintenance_t *m) {
+  if (!is_idle(m))
+    return false;
+
+  int64_t start = get_time_in_ms();
+  int64_t pages = 0;
+  int rc = SQLITE_OK;
+  int free_pages;
+  while (is_idle(m) &&
+         (free_pages = pragma_int(m->conn, "PRAGMA freelist_count")) > 0) {
+    int chunk = free_pages < m->options.vacuum_pages
+                ? free_pages : m->options.vacuum_pages;
+    string sql = string_printf("PRAGMA incremental_vacuum(%d)", chunk);
+    rc = sqlite3_exec(m->conn, string_get_data(sql), NULL, NULL, NULL);
+    string_delete(sql);
+    if (rc != SQLITE_OK)
+      break;
+
+    pages += chunk;
+  }
+
+  if (rc != SQLITE_OK && rc != SQLITE_BUSY)
+    printf("incremental vacuum failed(%d): %s\n", rc,
+           sqlite3_errmsg(m->conn));
+  if (pages == 0 && rc == SQLITE_OK)
+    return true;
+
+  pthread_mutex_lock(&m->lock);
+  m->stats.vacuumed_pages += pages;
+  pthread_mutex_unlock(&m->lock);
+  record(m, &m->stats.vacuum, start, rc == SQLITE_OK);
+  return true;
+}
+
+static int64_t next_run(int64_t now, int interval_ms) {
+  return interval_ms > 0 ? now + interval_ms : NEVER;
+}
+
+static void *maintenance_loop(void *arg) {
+  struct maintenance_t *m = (struct maintenance_t *) arg;
+  int64_t now = get_time_in_ms();
+  int64_t next_checkpoint = next_run(now, m->options.checkpoint_interval_ms);
+  int64_t next_optimize = next_run(now, m->options.optimize_interval_ms);
+  int64_t next_vacuum = m->vacuum_enabled
+                        ? next_run(now, m->options.vacuum_interval_ms)
+                        : NEVER;
+
+  pthread_mutex_lock(&m->lock);
+  while (!m->stop) {
+    int64_t wake_ms = next_checkpoint;
+    if (next_optimize < wake_ms)
+      wake_ms = next_optimize;
+    if (next_vacuum < wake_ms)
+      wake_ms = next_vacuum;
+
+    struct timespec deadline;
+    deadline.tv_sec = wake_ms / 1000;
+    deadline.tv_nsec = (wake_ms % 1000) * 1000000;
+    int rc = 0;
+    while (!m->stop && !m->urgent && rc != ETIMEDOUT) {
+      rc = wake_ms == NEVER
+           ? pthread_cond_wait(&m->wakeup, &m->lock)
+           : pthread_cond_timedwait(&m->wakeup, &m->lock, &deadline);
+    }
+
+    if (m->stop)
+      break;
+
+    bool urgent = m->urgent;
+    m->urgent = false;
+    pthread_mutex_unlock(&m->lock);
+
+    now = get_time_in_ms();
+    if (urgent || now >= next_checkpoint) {
+      run_checkpoint(m);
+      next_checkpoint = next_run(now, m->options.checkpoint_interval_ms);
+    }
+
+    if (now >= next_optimize) {
+      run_optimize(m);
+      next_optimize = next_run(now, m->options.optimize_interval_ms);
+    }
+
+    if (now >= next_vacuum) {
+      // Not idle yet: look again once the current burst may be over.
+      next_vacuum = run_vacuum(m)
+                    ? next_run(now, m->options.vacuum_interval_ms)
+                    : now + m->options.idle_ms;
+    }
+
+    pthread_mutex_lock(&m->lock);
+  }
+
+  pthread_mutex_unlock(&m->lock);
+  return NULL;
+}
+
+static void apply_defaults(db_maintenance_options *options) {
+  if (options->checkpoint_interval_ms == 0)
+    options->checkpoint_interval_ms = DEFAULT_CHECKPOINT_INTERVAL_MS;
+  if (options->wal_size_limit <= 0)
+    options->wal_size_limit = DEFAULT_WAL_SIZE_LIMIT;
+  if (options->optimize_interval_ms == 0)
+    options->optimize_interval_ms = DEFAULT_OPTIMIZE_INTERVAL_MS;
+  if (options->vacuum_interval_ms == 0)
+    options->vacuum_interval_ms = DEFAULT_VACUUM_INTERVAL_MS;
+  if (options->vacuum_pages <= 0)
+    options->vacuum_pages = DEFAULT_VACUUM_PAGES;
+  if (options->idle_ms <= 0)
+    options->idle_ms = DEFAULT_IDLE_MS;
+}
+
+static void stop_maintenance(struct maintenance_t *m) {
+  if (!m)
+    return;
+
+  if (m->running) {
+    pthread_mutex_lock(&m->lock);
+    __atomic_store_n(&m->stop, true, __ATOMIC_RELAXED);
+    pthread_cond_signal(&m->wakeup);
+    pthread_mutex_unlock(&m->lock);
+    pthread_join(m->thread, NULL);
+  }
+
+  if (m->options.checkpoint_interval_ms > 0) {
+    // Setting the default threshold puts SQLite's own hook back.
+    sqlite3_wal_hook(m->db, NULL, NULL);
+    sqlite3_wal_autocheckpoint(m->db, DEFAULT_WAL_AUTOCHECKPOINT);
+  }
+
+  sqlite3_close(m->conn);
+  pthread_cond_destroy(&m->wakeup);
+  pthread_mutex_destroy(&m->lock);
+  db_free(m);
+}
+
+int db_start_maintenance(sqlite3 *db, const db_maintenance_options *options) {
+  const char *path = sqlite3_db_filename(db, "main");
+  if (!path || !*path) {
+    printf("maintenance needs a database file\n");
+    return SQLITE_MISUSE;
+  }
+
+  connection_t *conn = connection_get(db);
+  if (!conn || conn->maintenance)
+    return SQLITE_MISUSE;
+
+  int rc = busy_exec(db, "PRAGMA journal_mode=WAL", NULL);
+  if (rc != SQLITE_OK) {
+    printf("failed to enable WAL: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3 *own = NULL;
+  rc = sqlite3_open_v2(path, &own,
+                       SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL);
+  if (rc != SQLITE_OK) {
+    printf("failed to open %s: %s\n", path, sqlite3_errmsg(own));
+    sqlite3_close(own);
+    return rc;
+  }
+
+  sqlite3_busy_timeout(own, ESCALATION_BUSY_TIMEOUT_MS);
+  sqlite3_wal_autocheckpoint(own, 0);
+  // Bound the rows ANALYZE looks at so optimize stays cheap on big tables.
+  sqlite3_exec(own, "PRAGMA analysis_limit=400", NULL, NULL, NULL);
+
+  struct maintenance_t *m =
+      (struct maintenance_t *) db_calloc(1, sizeof(struct maintenance_t));
+  m->db = db;
+  m->conn = own;
+  m->wal_path = sqlite3_filename_wal(path);
+  m->frame_size = pragma_int(own, "PRAGMA page_size") + WAL_FRAME_HEADER;
+  m->vacuum_enabled = pragma_int(own, "PRAGMA auto_vacuum") == 2;
+  if (options)
+    m->options = *options;
+  apply_defaults(&m->options);
+  m->last_write_ms = get_time_in_ms();
+  pthread_mutex_init(&m->lock, NULL);
+  pthread_cond_init(&m->wakeup, NULL);
+
+  // The hook replaces the auto-checkpoint of `db`, commits only record
+  // what the thread needs to know.
+  if (m->options.checkpoint_interval_ms > 0)
+    sqlite3_wal_hook(db, wal_hook, m);
+
+  m->running = pthread_create(&m->thread, NULL, maintenance_loop, m) == 0;
+  if (!m->running) {
+    printf("failed to start maintenance thread\n");
+    stop_maintenance(m);
+    return SQLITE_ERROR;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  conn->maintenance = m;
+  pthread_mutex_unlock(&conn->lock);
+  return SQLITE_OK;
+}
+
+static struct maintenance_t *take_maintenance(connection_t *conn) {
+  pthread_mutex_lock(&conn->lock);
+  struct maintenance_t *m = conn->maintenance;
+  conn->maintenance = NULL;
+  pthread_mutex_unlock(&conn->lock);
+  return m;
+}
+
+void db_stop_maintenance(sqlite3 *db) {
+  connection_t *conn = connection_find(db);
+  if (conn)
+    stop_maintenance(take_maintenance(conn));
+}
+
+bool db_maintenance_get_stats(sqlite3 *db, db_maintenance_stats *stats) {
+  connection_t *conn = connection_find(db);
+  if (!conn || !stats)
+    return false;
+
+  pthread_mutex_lock(&conn->lock);
+  struct maintenance_t *m = conn->maintenance;
+  if (m) {
+    pthread_mutex_lock(&m->lock);
+    *stats = m->stats;
+    pthread_mutex_unlock(&m->lock);
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+  return m != NULL;
+}
+
+void maintenance_release(connection_t *conn) {
+  stop_maintenance(take_maintenance(conn));
+}
@@ -0,0 +1,86 @@
+#include "memory_stats.h"
+
+#include <limits.h>
+#include <string.h>
+
+#include "connection.h"
+
+static int64_t db_status(sqlite3 *db, int op, bool highwater) {
+  int current = 0;
+  int peak = 0;
+  sqlite3_db_status(db, op, &current, &peak, 0);
+  return highwater ? peak : current;
+}
+
+int db_memory_stats(sqlite3 *db, db_mem_stats *stats) {
+  if (!stats)
+    return SQLITE_MISUSE;
+
+  memset(stats, 0, sizeof(db_mem_stats));
+  sqlite3_int64 current = 0;
+  sqlite3_int64 peak = 0;
+  sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &current, &peak, 0);
+  stats->sqlite_memory_used = current;
+  stats->sqlite_memory_peak = peak;
+  sqlite3_status64(SQLITE_STATUS_PAGECACHE_USED, &current, &peak, 0);
+  stats->pagecache_used = current;
+  sqlite3_status64(SQLITE_STATUS_PAGECACHE_OVERFLOW, &current, &peak, 0);
+  stats->pagecache_overflow = current;
+
+  if (db) {
+    stats->cache_used = db_status(db, SQLITE_DBSTATUS_CACHE_USED, false);
+    stats->cache_hit = db_status(db, SQLITE_DBSTATUS_CACHE_HIT, false);
+    stats->cache_miss = db_status(db, SQLITE_DBSTATUS_CACHE_MISS, false);
+    stats->cache_write = db_status(db, SQLITE_DBSTATUS_CACHE_WRITE, false);
+    stats->lookaside_used =
+        db_status(db, SQLITE_DBSTATUS_LOOKASIDE_USED, false);
+    // The lookaside counters are reported through the highwater value.
+    stats->lookaside_hit = db_status(db, SQLITE_DBSTATUS_LOOKASIDE_HIT, true);
+    stats->lookaside_miss_size =
+        db_status(db, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, true);
+    stats->lookaside_miss_full =
+        db_status(db, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, true);
+    stats->schema_used = db_status(db, SQLITE_DBSTATUS_SCHEMA_USED, false);
+    stats->stmt_used = db_status(db, SQLITE_DBSTATUS_STMT_USED, false);
+  }
+
+  db_alloc_stats alloc;
+  db_alloc_get_stats(&alloc);
+  stats->wrapper_live_bytes = alloc.live_bytes;
+  stats->content_bytes = alloc.tag_bytes[MEM_CONTENT];
+  stats->cursor_bytes = alloc.tag_bytes[MEM_CURSOR];
+  stats->string_bytes = alloc.tag_bytes[MEM_STRING];
+  stats->cache_bytes = alloc.tag_bytes[MEM_CACHE];
+  stats->pool_free_bytes = alloc.pool_free_bytes;
+  return SQLITE_OK;
+}
+
+static int64_t held_bytes(sqlite3 *db) {
+  db_mem_stats stats;
+  db_memory_stats(db, &stats);
+  return stats.cache_used + stats.stmt_used + stats.wrapper_live_bytes +
+         stats.pool_free_bytes;
+}
+
+int64_t db_release_memory(sqlite3 *db) {
+  if (!db) {
+    int64_t before = held_bytes(NULL);
+    // Only frees anything when SQLite is built with
+    // SQLITE_ENABLE_MEMORY_MANAGEMENT.
+    int64_t released = sqlite3_release_memory(INT_MAX);
+    db_pool_trim();
+    int64_t trimmed = before - held_bytes(NULL);
+    return released + (trimmed > 0 ? trimmed : 0);
+  }
+
+  int64_t before = held_bytes(db);
+  connection_t *conn = connection_find(db);
+  if (conn) {
+    struct_stmts_trim(conn);
+    diagnostics_trim(conn);
+  }
+  sqlite3_db_release_memory(db);
+  db_pool_trim();
+  int64_t released = before - held_bytes(db);
+  return released > 0 ? released : 0;
+}
@@ -0,0 +1,357 @@
+#include "pager.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "query_builder.h"
+#include "statement.h"
+
+// Token layout, hex encoded: per key a type byte, then 8 bytes for an
+// integer or a double, or a 4 byte length and the bytes for text and blobs.
+// NULL has no place in a row value comparison, keys never hold one.
+enum {
+  KEY_INT = 'i',
+  KEY_FLOAT = 'f',
+  KEY_TEXT = 't',
+  KEY_BLOB = 'b'
+};
+
+typedef struct buffer_t {
+  uint8_t *data;
+  size_t len;
+  size_t capacity;
+} buffer_t;
+
+struct pager_t {
+  sqlite3 *db;
+  db_stmt first;            /* First page */
+  db_stmt next;             /* Pages after a token */
+  int key_count;
+  int page_size;
+  buffer_t last;            /* Keys of the last row read, raw */
+  buffer_t bound;           /* Decoded token, bound to `next` */
+  buffer_t token;           /* Hex of `last` */
+  bool has_token;
+};
+
+static void buffer_reserve(buffer_t *buf, size_t extra) {
+  if (buf->len + extra <= buf->capacity)
+    return;
+
+  size_t capacity = buf->capacity ? buf->capacity * 2 : 64;
+  while (capacity < buf->len + extra) {
+    capacity *= 2;
+  }
+
+  buf->data = (uint8_t *) db_tag(db_realloc(buf->data, capacity), MEM_CURSOR);
+  buf->capacity = capacity;
+}
+
+static void buffer_append(buffer_t *buf, const void *data, size_t len) {
+  buffer_reserve(buf, len);
+  if (len > 0)
+    memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+static void append_u64(buffer_t *buf, uint64_t v) {
+  uint8_t bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (uint8_t) (v >> (8 * i));
+  }
+
+  buffer_append(buf, bytes, 8);
+}
+
+static uint64_t read_u64(const uint8_t *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++) {
+    v |= (uint64_t) p[i] << (8 * i);
+  }
+
+  return v;
+}
+
+static string build_pager_query(const char *table, db_column columns,
+                                db_column keys, const char *where,
+                                bool after) {
+  db_column selected = columns_new();
+  if (columns_size(columns) == 0)
+    columns_push(&selected, "*");
+  for (size_t i = 0; i < columns_size(columns); i++) {
+    columns_push(&selected, columns_get_name(columns, i));
+  }
+
+  string order_by = string_new();
+  string seek = string_new();
+  string_append(seek, "(");
+  for (size_t i = 0; i < columns_size(keys); i++) {
+    const char *key = columns_get_name(keys, i);
+    columns_push(&selected, key);
+    if (i > 0) {
+      string_append(order_by, ", ");
+      string_append(seek, ", ");
+    }
+
+    string_append(order_by, key);
+    string_append(seek, key);
+  }
+
+  string_append(seek, ") > (");
+  for (size_t i = 0; i < columns_size(keys); i++) {
+    string param = string_printf(i > 0 ? ", ?%zu" : "?%zu", i + 1);
+    string_append(seek, string_get_data(param));
+    string_delete(param);
+  }
+
+  string_append(seek, ")");
+  if (where) {
+    string_append(seek, " AND (");
+    string_append(seek, where);
+    string_append(seek, ")");
+  }
+
+  // The page size is always the parameter after the keys.
+  string limit = string_printf("?%zu", columns_size(keys) + 1);
+  string sql = build_query_string(false, table, selected,
+                                  after ? string_get_data(seek) : where,
+                                  NULL, NULL, string_get_data(order_by),
+                                  string_get_data(limit));
+  string_delete(limit);
+  string_delete(seek);
+  string_delete(order_by);
+  columns_delete(selected);
+  return sql;
+}
+
+static db_stmt prepare_page(sqlite3 *db, const char *table,
+                            db_column columns, db_column keys,
+                            const char *where, bool after) {
+  string sql = build_pager_query(table, columns, keys, where, after);
+  db_stmt stmt = db_prepare(db, string_get_data(sql));
+  string_delete(sql);
+  return stmt;
+}
+
+db_pager db_pager_new(sqlite3 *db, const char *table, db_column columns,
+                      db_column keys, const char *where, int page_size) {
+  if (!db || !table || columns_size(keys) == 0 || page_size <= 0)
+    return NULL;
+
+  db_pager pager = (db_pager)
+      db_tag(db_calloc(1, sizeof(struct pager_t)), MEM_CURSOR);
+  pager->db = db;
+  pager->key_count = (int) columns_size(keys);
+  pager->page_size = page_size;
+  pager->first = prepare_page(db, table, columns, keys, where, false);
+  pager->next = prepare_page(db, table, columns, keys, where, true);
+  if (!pager->first || !pager->next) {
+    db_pager_delete(pager);
+    return NULL;
+  }
+
+  return pager;
+}
+
+void db_pager_delete(db_pager pager) {
+  if (!pager)
+    return;
+
+  db_stmt_finalize(pager->first);
+  db_stmt_finalize(pager->next);
+  db_free(pager->last.data);
+  db_free(pager->bound.data);
+  db_free(pager->token.data);
+  db_free(pager);
+}
+
+// Remember the keys of the current row, the last columns of the row. False
+// when one is NULL.
+static bool save_last_key(db_pager pager, sqlite3_stmt *stmt) {
+  pager->last.len = 0;
+  int first = sqlite3_column_count(stmt) - pager->key_count;
+  for (int i = 0; i < pager->key_count; i++) {
+    int col = first + i;
+    uint8_t type;
+    switch (sqlite3_column_type(stmt, col)) {
+      case SQLITE_INTEGER:type = KEY_INT;
+        buffer_append(&pager->last, &type, 1);
+        append_u64(&pager->last, (uint64_t) sqlite3_column_int64(stmt, col));
+        break;
+      case SQLITE_FLOAT: {
+        type = KEY_FLOAT;
+        double d = sqlite3_column_double(stmt, col);
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        buffer_append(&pager->last, &type, 1);
+        append_u64(&pager->last, bits);
+        break;
+      }
+      case SQLITE_TEXT:
+      case SQLITE_BLOB: {
+        bool text = sqlite3_column_type(stmt, col) == SQLITE_TEXT;
+        type = text ? KEY_TEXT : KEY_BLOB;
+        const void *data = text ? (const void *) sqlite3_column_text(stmt, col)
+                                : sqlite3_column_blob(stmt, col);
+        uint32_t len = (uint32_t) sqlite3_column_bytes(stmt, col);
+        uint8_t len_bytes[4] = {(uint8_t) len, (uint8_t) (len >> 8),
+                                (uint8_t) (len >> 16), (uint8_t) (len >> 24)};
+        buffer_append(&pager->last, &type, 1);
+        buffer_append(&pager->last, len_bytes, 4);
+        buffer_append(&pager->last, data, len);
+        break;
+      }
+      default:printf("NULL page key in column %d\n", col);
+        return false;
+    }
+  }
+
+  return true;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+// Decode `token` into pager->bound and bind the keys to pager->next.
+static int bind_token(db_pager pager, const char *token) {
+  size_t hex_len = strlen(token);
+  if (hex_len % 2 != 0)
+    return SQLITE_MISMATCH;
+
+  pager->bound.len = 0;
+  buffer_reserve(&pager->bound, hex_len / 2);
+  for (size_t i = 0; i < hex_len; i += 2) {
+    int hi = hex_value(token[i]);
+    int lo = hex_value(token[i + 1]);
+    if (hi < 0 || lo < 0)
+      return SQLITE_MISMATCH;
+    pager->bound.data[pager->bound.len++] = (uint8_t) (hi << 4 | lo);
+  }
+
+  const uint8_t *p = pager->bound.data;
+  const uint8_t *end = p + pager->bound.len;
+  for (int i = 1; i <= pager->key_count; i++) {
+    if (p >= end)
+      return SQLITE_MISMATCH;
+
+    uint8_t type = *p++;
+    if (type == KEY_INT || type == KEY_FLOAT) {
+      if (end - p < 8)
+        return SQLITE_MISMATCH;
+      uint64_t bits = read_u64(p);
+      p += 8;
+      if (type == KEY_INT) {
+        db_stmt_bind_int64(pager->next, i, (int64_t) bits);
+      } else {
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        db_stmt_bind_double(pager->next, i, d);
+      }
+    } else if (type == KEY_TEXT || type == KEY_BLOB) {
+      if (end - p < 4)
+        return SQLITE_MISMATCH;
+      uint32_t len = (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+                     (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+      p += 4;
+      if ((size_t) (end - p) < len)
+        return SQLITE_MISMATCH;
+      // Zero-length text and blobs still need a non-NULL pointer.
+      const char *data = len > 0 ? (const char *) p : "";
+      if (type == KEY_TEXT) {
+        db_stmt_bind_text(pager->next, i, data, (int) len);
+      } else {
+        db_stmt_bind_blob(pager->next, i, data, (int) len);
+      }
+      p += len;
+    } else {
+      return SQLITE_MISMATCH;
+    }
+  }
+
+  return p == end ? SQLITE_OK : SQLITE_MISMATCH;
+}
+
+static void make_token(db_pager pager) {
+  static const char digits[] = "0123456789abcdef";
+  pager->token.len = 0;
+  buffer_reserve(&pager->token, pager->last.len * 2 + 1);
+  for (size_t i = 0; i < pager->last.len; i++) {
+    pager->token.data[pager->token.len++] = digits[pager->last.data[i] >> 4];
+    pager->token.data[pager->token.len++] = digits[pager->last.data[i] & 0xf];
+  }
+
+  pager->token.data[pager->token.len] = '\0';
+}
+
+int db_pager_fetch(db_pager pager, const char *token,
+                   db_page_callback callback, void *arg) {
+  if (!pager || !callback)
+    return SQLITE_MISUSE;
+
+  db_stmt stmt = pager->first;
+  if (token && *token) {
+    stmt = pager->next;
+    // `token` may be our own buffer, it is fully decoded before any row
+    // overwrites it.
+    int rc = bind_token(pager, token);
+    if (rc != SQLITE_OK) {
+      printf("invalid page token\n");
+      db_stmt_reset(stmt);
+      return rc;
+    }
+  }
+
+  pager->has_token = false;
+  db_stmt_bind_int(stmt, pager->key_count + 1, pager->page_size);
+  int rc = db_stmt_step(stmt);
+  db_cursor cursor = rc == SQLITE_ROW ? db_stmt_cursor(stmt) : NULL;
+  int rows = 0;
+  bool stopped = false;
+  bool null_key = false;
+  bool more = cursor != NULL;
+  while (more) {
+    rows++;
+    // (k1, ...) > (NULL, ...) matches nothing, a token made from this row
+    // would end the paging early.
+    if (!save_last_key(pager, db_stmt_handle(stmt))) {
+      null_key = true;
+      break;
+    }
+
+    if (!callback(cursor, arg)) {
+      stopped = true;
+      break;
+    }
+
+    more = cursor_next(cursor) != NULL;
+  }
+
+  if (cursor) {
+    rc = null_key ? SQLITE_MISMATCH
+                  : stopped ? SQLITE_DONE : cursor_status(cursor);
+    cursorDelete(cursor);
+  }
+
+  db_stmt_reset(stmt);
+  if (rc != SQLITE_DONE)
+    return rc;
+
+  // A full page may be followed by more rows, a short one is the last.
+  if (rows > 0 && (stopped || rows == pager->page_size)) {
+    make_token(pager);
+    pager->has_token = true;
+  }
+
+  return SQLITE_OK;
+}
+
+const char *db_pager_next_token(db_pager pager) {
+  return pager && pager->has_token ? (const char *) pager->token.data : NULL;
+}
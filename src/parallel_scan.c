@@ -0,0 +1,189 @@
+#include "parallel_scan.h"
+
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "query_builder.h"
+
+struct scan_range_t {
+  const char *db_path;
+  string sql;
+  int part;
+  int rc;
+  db_scan_row_callback row_callback;
+  void *ctx;
+};
+
+static int open_and_probe(const char *db_path, const char *table,
+                          sqlite3_int64 *min_rowid,
+                          sqlite3_int64 *max_rowid) {
+  sqlite3 *db = NULL;
+  int rc = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL);
+  if (rc != SQLITE_OK) {
+    printf("failed to open %s: %s\n", db_path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return rc;
+  }
+
+  // Readers in WAL mode never block each other or the writer.
+  sqlite3_exec(db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+
+  string sql = string_printf("SELECT min(rowid), max(rowid) FROM %s", table);
+  sqlite3_stmt *stmt = NULL;
+  rc = sqlite3_prepare_v2(db, string_get_data(sql), -1, &stmt, NULL);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+      *min_rowid = sqlite3_column_int64(stmt, 0);
+      *max_rowid = sqlite3_column_int64(stmt, 1);
+      // An empty table has no range to scan.
+      rc = sqlite3_column_type(stmt, 0) == SQLITE_NULL ? SQLITE_DONE
+                                                       : SQLITE_OK;
+    }
+  } else {
+    printf("failed to probe rowid range of %s: %s\n",
+           table, sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(stmt);
+  string_delete(sql);
+  sqlite3_close(db);
+  return rc;
+}
+
+static void *scan_range(void *arg) {
+  struct scan_range_t *range = (struct scan_range_t *) arg;
+  sqlite3 *db = NULL;
+  // Every worker owns its connection, so the per-connection mutex is useless.
+  range->rc = sqlite3_open_v2(range->db_path, &db,
+                              SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+                              NULL);
+  if (range->rc != SQLITE_OK) {
+    printf("range %d: failed to open DB: %s\n",
+           range->part, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+
+  sqlite3_stmt *stmt = NULL;
+  range->rc = sqlite3_prepare_v2(db, string_get_data(range->sql), -1,
+                                 &stmt, NULL);
+  if (range->rc != SQLITE_OK) {
+    printf("range %d: failed to prepare %s: %s\n",
+           range->part, string_get_data(range->sql), sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+
+  int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    db_cursor cursor = cursor_new(db, stmt);
+    bool stopped = false;
+    do {
+      stopped = range->row_callback(cursor, range->part, range->ctx) != 0;
+    } while (!stopped && cursor_next(cursor));
+
+    // A range stopped by its callback is complete, one whose step failed is
+    // not.
+    rc = stopped ? SQLITE_DONE : cursor_status(cursor);
+    range->rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+    // cursorDelete finalizes the statement.
+    cursorDelete(cursor);
+  } else {
+    sqlite3_finalize(stmt);
+    range->rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+  }
+
+  sqlite3_close(db);
+  return NULL;
+}
+
+int db_parallel_scan(const char *db_path, const char *table,
+                     db_column columns, const char *where, int nthreads,
+                     db_scan_row_callback row_callback,
+                     db_scan_reduce_callback reduce, void *ctx) {
+  if (!row_callback || nthreads <= 0) {
+    printf("invalid parallel scan arguments\n");
+    return SQLITE_MISUSE;
+  }
+
+  sqlite3_int64 min_rowid = 0, max_rowid = 0;
+  int rc = open_and_probe(db_path, table, &min_rowid, &max_rowid);
+  if (rc == SQLITE_DONE)
+    return SQLITE_OK;
+  if (rc != SQLITE_OK)
+    return rc;
+
+  // Rowids may span more than INT64_MAX, the distance is taken unsigned.
+  // `span` is one less than the number of rowids, so the full range of
+  // 2^64 rowids still fits.
+  sqlite3_uint64 span = (sqlite3_uint64) max_rowid - (sqlite3_uint64) min_rowid;
+  // Never hand out more ranges than there are rowids.
+  if ((sqlite3_uint64) nthreads - 1 > span)
+    nthreads = (int) span + 1;
+
+  sqlite3_uint64 step = span / nthreads + 1;
+  struct scan_range_t *ranges =
+      (struct scan_range_t *) db_calloc(nthreads, sizeof(struct scan_range_t));
+  pthread_t *threads = (pthread_t *) db_calloc(nthreads, sizeof(pthread_t));
+  bool *started = (bool *) db_calloc(nthreads, sizeof(bool));
+
+  for (int i = 0; i < nthreads; i++) {
+    sqlite3_uint64 first = (sqlite3_uint64) min_rowid + step * i;
+    sqlite3_int64 lo = (sqlite3_int64) first;
+    sqlite3_int64 hi = i == nthreads - 1
+                       ? max_rowid : (sqlite3_int64) (first + step - 1);
+    string range_where = NULL;
+    if (where && strlen(where) > 0) {
+      range_where = string_printf("(%s) AND rowid BETWEEN %lld AND %lld",
+                                  where, (long long) lo, (long long) hi);
+    } else {
+      range_where = string_printf("rowid BETWEEN %lld AND %lld",
+                                  (long long) lo, (long long) hi);
+    }
+
+    ranges[i].db_path = db_path;
+    ranges[i].sql = build_query_string(false, table, columns,
+                                       string_get_data(range_where),
+                                       NULL, NULL, NULL, NULL);
+    ranges[i].part = i;
+    ranges[i].rc = SQLITE_OK;
+    ranges[i].row_callback = row_callback;
+    ranges[i].ctx = ctx;
+    string_delete(range_where);
+
+    if (pthread_create(&threads[i], NULL, scan_range, &ranges[i]) == 0) {
+      started[i] = true;
+    } else {
+      printf("failed to start scan thread %d, scanning inline\n", i);
+      scan_range(&ranges[i]);
+    }
+  }
+
+  rc = SQLITE_OK;
+  for (int i = 0; i < nthreads; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    if (rc == SQLITE_OK && ranges[i].rc != SQLITE_OK)
+      rc = ranges[i].rc;
+  }
+
+  // Partial results of a failed scan are not merged.
+  if (reduce && rc == SQLITE_OK) {
+    for (int i = 0; i < nthreads; i++) {
+      reduce(i, ctx);
+    }
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    string_delete(ranges[i].sql);
+  }
+
+  db_free(started);
+  db_free(threads);
+  db_free(ranges);
+  return rc;
+}
@@ -0,0 +1,567 @@
+#include "partition.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "query_builder.h"
+#include "sqlite_wrapper.h"
+
+typedef struct part_t {
+  int64_t key;              /* YYYYMMDD or YYYYMMDDHH */
+  bool attached;            /* File partitions only */
+} part_t;
+
+struct partition_t {
+  char *table;
+  char *ts_column;
+  char *columns_sql;
+  char *dir;                /* NULL for partitions kept as tables */
+  db_partition_unit unit;
+  pthread_mutex_t lock;     /* Guards the fields below */
+  part_t *parts;            /* Sorted by key */
+  size_t count;
+  size_t capacity;
+  struct partition_t *next;
+};
+
+// Partitioned tables on every connection, db_insert skips the lookup when
+// there are none.
+static int g_partition_count = 0;
+
+static char *copy_text(const char *s) {
+  return s ? (char *) db_tag(db_strdup(s), MEM_CACHE) : NULL;
+}
+
+static int64_t partition_key(db_partition_unit unit, int64_t ts) {
+  time_t t = (time_t) ts;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  int64_t key = (int64_t) (tm.tm_year + 1900) * 10000 +
+                (tm.tm_mon + 1) * 100 + tm.tm_mday;
+  return unit == PARTITION_HOUR ? key * 100 + tm.tm_hour : key;
+}
+
+// Schema of a file partition, or table name of a table partition.
+static string partition_name(struct partition_t *p, int64_t key) {
+  return string_printf("%s_p%lld", p->table, (long long) key);
+}
+
+// How SQL refers to the partition table.
+static string partition_ref(struct partition_t *p, int64_t key) {
+  if (p->dir)
+    return string_printf("%s_p%lld.%s", p->table, (long long) key, p->table);
+  return partition_name(p, key);
+}
+
+static string partition_path(struct partition_t *p, int64_t key) {
+  return string_printf("%s/%s_p%lld.db", p->dir, p->table, (long long) key);
+}
+
+// Parse the key of a partition named `name`, which must be `prefix`
+// followed by the digits of the partition unit and then `suffix`.
+static bool parse_key(struct partition_t *p, const char *name,
+                      const char *prefix, const char *suffix,
+                      int64_t *key) {
+  size_t digits = p->unit == PARTITION_HOUR ? 10 : 8;
+  size_t prefix_len = strlen(prefix);
+  if (strncmp(name, prefix, prefix_len) != 0 ||
+      strlen(name) != prefix_len + digits + strlen(suffix) ||
+      strcmp(name + prefix_len + digits, suffix) != 0)
+    return false;
+
+  for (size_t i = 0; i < digits; i++) {
+    if (!isdigit((unsigned char) name[prefix_len + i]))
+      return false;
+  }
+
+  *key = strtoll(name + prefix_len, NULL, 10);
+  return true;
+}
+
+static ssize_t find_part(struct partition_t *p, int64_t key) {
+  size_t lo = 0;
+  size_t hi = p->count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (p->parts[mid].key < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo < p->count && p->parts[lo].key == key ? (ssize_t) lo : -1;
+}
+
+static size_t add_part(struct partition_t *p, int64_t key) {
+  if (p->count == p->capacity) {
+    p->capacity = p->capacity ? p->capacity * 2 : 16;
+    p->parts = (part_t *) db_tag(
+        db_realloc(p->parts, p->capacity * sizeof(part_t)), MEM_CACHE);
+  }
+
+  size_t idx = p->count;
+  while (idx > 0 && p->parts[idx - 1].key > key) {
+    p->parts[idx] = p->parts[idx - 1];
+    idx--;
+  }
+
+  p->parts[idx].key = key;
+  p->parts[idx].attached = false;
+  p->count++;
+  return idx;
+}
+
+static void remove_part(struct partition_t *p, size_t idx) {
+  memmove(&p->parts[idx], &p->parts[idx + 1],
+          (p->count - idx - 1) * sizeof(part_t));
+  p->count--;
+}
+
+static int detach_part(sqlite3 *db, struct partition_t *p, size_t idx) {
+  if (!p->parts[idx].attached)
+    return SQLITE_OK;
+
+  string name = partition_name(p, p->parts[idx].key);
+  string sql = string_printf("DETACH %s", string_get_data(name));
+  int rc = busy_exec(db, string_get_data(sql), NULL);
+  if (rc != SQLITE_OK) {
+    printf("failed to detach %s: %s\n", string_get_data(name),
+           sqlite3_errmsg(db));
+  } else {
+    p->parts[idx].attached = false;
+  }
+
+  string_delete(sql);
+  string_delete(name);
+  return rc;
+}
+
+// Whether the last ATTACH failed for lack of a free slot, SQLite reports it
+// as a plain SQLITE_ERROR.
+static bool out_of_slots(sqlite3 *db) {
+  static const char message[] = "too many attached databases";
+  return strncmp(sqlite3_errmsg(db), message, sizeof(message) - 1) == 0;
+}
+
+// Attach a file partition. When SQLite runs out of attach slots, file
+// partitions outside [lo, hi] are detached to make room.
+static int attach_part(sqlite3 *db, struct partition_t *p, size_t idx,
+                       int64_t lo, int64_t hi) {
+  if (p->parts[idx].attached)
+    return SQLITE_OK;
+
+  string name = partition_name(p, p->parts[idx].key);
+  string path = partition_path(p, p->parts[idx].key);
+  string sql = string_printf("ATTACH ?1 AS %s", string_get_data(name));
+  int rc;
+  for (;;) {
+    sqlite3_stmt *stmt = NULL;
+    rc = sqlite3_prepare_v2(db, string_get_data(sql), -1, &stmt, NULL);
+    if (rc == SQLITE_OK) {
+      sqlite3_bind_text(stmt, 1, string_get_data(path), -1, SQLITE_STATIC);
+      rc = busy_step(db, stmt);
+      rc = rc == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+    }
+
+    sqlite3_finalize(stmt);
+    // A file that can not be opened or read stays so whatever is detached.
+    if (rc == SQLITE_OK || sqlite3_get_autocommit(db) == 0 ||
+        !out_of_slots(db))
+      break;
+
+    // Oldest first: queries mostly read the recent partitions.
+    size_t victim = 0;
+    while (victim < p->count &&
+           (!p->parts[victim].attached ||
+            (p->parts[victim].key >= lo && p->parts[victim].key <= hi))) {
+      victim++;
+    }
+
+    if (victim == p->count || detach_part(db, p, victim) != SQLITE_OK)
+      break;
+  }
+
+  if (rc == SQLITE_OK) {
+    p->parts[idx].attached = true;
+  } else {
+    printf("failed to attach %s: %s\n", string_get_data(path),
+           sqlite3_errmsg(db));
+  }
+
+  string_delete(sql);
+  string_delete(path);
+  string_delete(name);
+  return rc;
+}
+
+static int create_part(sqlite3 *db, struct partition_t *p, int64_t key) {
+  string name = partition_name(p, key);
+  // An attached file holds one table named after the partitioned table.
+  string sql = p->dir
+      ? string_printf("CREATE TABLE IF NOT EXISTS %s.%s(%s);"
+                      "CREATE INDEX IF NOT EXISTS %s.%s_%s ON %s(%s)",
+                      string_get_data(name), p->table, p->columns_sql,
+                      string_get_data(name), p->table, p->ts_column,
+                      p->table, p->ts_column)
+      : string_printf("CREATE TABLE IF NOT EXISTS %s(%s);"
+                      "CREATE INDEX IF NOT EXISTS %s_%s ON %s(%s)",
+                      string_get_data(name), p->columns_sql,
+                      string_get_data(name), p->ts_column,
+                      string_get_data(name), p->ts_column);
+  int rc = busy_exec(db, string_get_data(sql), NULL);
+  if (rc != SQLITE_OK)
+    printf("failed to create partition %s: %s\n", string_get_data(name),
+           sqlite3_errmsg(db));
+  string_delete(sql);
+  string_delete(name);
+  return rc;
+}
+
+// Make the partition of `key` exist and be readable, under p->lock.
+static int ensure_part(sqlite3 *db, struct partition_t *p, int64_t key,
+                       int64_t lo, int64_t hi) {
+  ssize_t found = find_part(p, key);
+  size_t idx = found >= 0 ? (size_t) found : add_part(p, key);
+  int rc = p->dir ? attach_part(db, p, idx, lo, hi) : SQLITE_OK;
+  if (found >= 0)
+    return rc;
+
+  if (rc == SQLITE_OK)
+    rc = create_part(db, p, key);
+  if (rc != SQLITE_OK) {
+    detach_part(db, p, idx);
+    remove_part(p, idx);
+  }
+
+  return rc;
+}
+
+static void discover_tables(sqlite3 *db, struct partition_t *p) {
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, "SELECT name FROM sqlite_master WHERE type = "
+                             "'table' AND name GLOB ?1 || '_p[0-9]*'", -1,
+                         &stmt, NULL) != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    return;
+  }
+
+  sqlite3_bind_text(stmt, 1, p->table, -1, SQLITE_STATIC);
+  string prefix = string_printf("%s_p", p->table);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    int64_t key;
+    if (parse_key(p, (const char *) sqlite3_column_text(stmt, 0),
+                  string_get_data(prefix), "", &key))
+      add_part(p, key);
+  }
+
+  string_delete(prefix);
+  sqlite3_finalize(stmt);
+}
+
+static void discover_files(struct partition_t *p) {
+  DIR *dir = opendir(p->dir);
+  if (!dir)
+    return;
+
+  string prefix = string_printf("%s_p", p->table);
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int64_t key;
+    if (parse_key(p, entry->d_name, string_get_data(prefix), ".db", &key))
+      add_part(p, key);
+  }
+
+  string_delete(prefix);
+  closedir(dir);
+}
+
+static struct partition_t *find_partition(sqlite3 *db, const char *table) {
+  if (__atomic_load_n(&g_partition_count, __ATOMIC_RELAXED) == 0 || !table)
+    return NULL;
+
+  connection_t *conn = connection_find(db);
+  if (!conn)
+    return NULL;
+
+  pthread_mutex_lock(&conn->lock);
+  struct partition_t *p = conn->partitions;
+  while (p && strcasecmp(p->table, table) != 0) {
+    p = p->next;
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+  return p;
+}
+
+bool partitioned(sqlite3 *db, const char *table) {
+  return find_partition(db, table) != NULL;
+}
+
+const char *partition_parent(sqlite3 *db, const char *name) {
+  if (__atomic_load_n(&g_partition_count, __ATOMIC_RELAXED) == 0 || !name)
+    return NULL;
+
+  connection_t *conn = connection_find(db);
+  if (!conn)
+    return NULL;
+
+  const char *parent = NULL;
+  pthread_mutex_lock(&conn->lock);
+  for (struct partition_t *p = conn->partitions; p && !parent; p = p->next) {
+    size_t len = strlen(p->table);
+    int64_t key;
+    // File partitions keep the name of the table they belong to.
+    if (!p->dir && strncasecmp(name, p->table, len) == 0 &&
+        parse_key(p, name + len, "_p", "", &key))
+      parent = p->table;
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+  return parent;
+}
+
+int db_partition_table(sqlite3 *db, const char *table,
+                       const db_partition_options *options) {
+  if (!table || !options || !options->ts_column || !options->columns_sql ||
+      (options->unit != PARTITION_DAY && options->unit != PARTITION_HOUR))
+    return SQLITE_MISUSE;
+
+  connection_t *conn = connection_get(db);
+  if (!conn || find_partition(db, table))
+    return SQLITE_MISUSE;
+
+  struct partition_t *p = (struct partition_t *)
+      db_tag(db_calloc(1, sizeof(struct partition_t)), MEM_CACHE);
+  p->table = copy_text(table);
+  p->ts_column = copy_text(options->ts_column);
+  p->columns_sql = copy_text(options->columns_sql);
+  p->dir = copy_text(options->dir);
+  p->unit = options->unit;
+  pthread_mutex_init(&p->lock, NULL);
+  if (p->dir) {
+    discover_files(p);
+  } else {
+    discover_tables(db, p);
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  p->next = conn->partitions;
+  conn->partitions = p;
+  pthread_mutex_unlock(&conn->lock);
+  __atomic_fetch_add(&g_partition_count, 1, __ATOMIC_RELAXED);
+  return SQLITE_OK;
+}
+
+int partition_route(sqlite3 *db, const char *table, db_content content,
+                    string *target) {
+  *target = NULL;
+  struct partition_t *p = find_partition(db, table);
+  if (!p)
+    return SQLITE_OK;
+
+  db_value value = content_get_value(content, p->ts_column);
+  int64_t ts;
+  switch (content_get_type(value)) {
+    case VALUE_INT:ts = content_get_int(value);
+      break;
+    case VALUE_DOUBLE:ts = (int64_t) content_get_double(value);
+      break;
+    default:printf("no %s to partition %s by\n", p->ts_column, table);
+      return SQLITE_MISMATCH;
+  }
+
+  int64_t key = partition_key(p->unit, ts);
+  pthread_mutex_lock(&p->lock);
+  int rc = ensure_part(db, p, key, key, key);
+  if (rc == SQLITE_OK)
+    *target = partition_ref(p, key);
+  pthread_mutex_unlock(&p->lock);
+  return rc;
+}
+
+db_cursor db_partition_query(sqlite3 *db, const char *table,
+                             db_column columns, int64_t from_ts,
+                             int64_t to_ts, const char *where,
+                             const char *order_by, const char *limit) {
+  struct partition_t *p = find_partition(db, table);
+  if (!p) {
+    printf("%s is not partitioned\n", table ? table : "(null)");
+    return NULL;
+  }
+
+  bool bounded = to_ts > 0;
+  if (bounded && to_ts <= from_ts)
+    return NULL;
+
+  int64_t lo = partition_key(p->unit, from_ts);
+  int64_t hi = bounded ? partition_key(p->unit, to_ts - 1) : INT64_MAX;
+  string sql = string_new();
+  string_append(sql, "SELECT ");
+  if (columns_size(columns) == 0) {
+    string_append(sql, "*");
+  } else {
+    for (size_t i = 0; i < columns_size(columns); i++) {
+      if (i > 0) {
+        string_append(sql, ", ");
+      }
+
+      string_append(sql, columns_get_name(columns, i));
+    }
+  }
+
+  string_append(sql, " FROM (");
+  size_t used = 0;
+  int rc = SQLITE_OK;
+  pthread_mutex_lock(&p->lock);
+  if (p->dir) {
+    size_t needed = 0;
+    for (size_t i = 0; i < p->count; i++) {
+      if (p->parts[i].key >= lo && p->parts[i].key <= hi)
+        needed++;
+    }
+
+    int slots = sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1);
+    if (needed > (size_t) slots) {
+      printf("%zu partitions of %s do not fit in %d attach slots, split "
+             "the range\n", needed, table, slots);
+      rc = SQLITE_RANGE;
+    }
+  }
+
+  for (size_t i = 0; i < p->count && rc == SQLITE_OK; i++) {
+    if (p->parts[i].key < lo || p->parts[i].key > hi)
+      continue;
+
+    // Leaving a partition out would return part of the range as if it were
+    // all of it.
+    if (p->dir && (rc = attach_part(db, p, i, lo, hi)) != SQLITE_OK)
+      break;
+
+    string ref = partition_ref(p, p->parts[i].key);
+    string_append(sql, used++ > 0 ? " UNION ALL SELECT * FROM "
+                                  : "SELECT * FROM ");
+    string_append(sql, string_get_data(ref));
+    string_delete(ref);
+  }
+
+  pthread_mutex_unlock(&p->lock);
+  if (rc != SQLITE_OK) {
+    printf("failed to query %s, error(%d)\n", table, rc);
+    string_delete(sql);
+    return NULL;
+  }
+
+  // The time bounds are pushed down into every branch of the union, where
+  // the partition index serves them.
+  string bounds = string_printf(") AS %s WHERE %s >= %lld", table,
+                                p->ts_column, (long long) from_ts);
+  string_append(sql, string_get_data(bounds));
+  string_delete(bounds);
+  if (bounded) {
+    bounds = string_printf(" AND %s < %lld", p->ts_column, (long long) to_ts);
+    string_append(sql, string_get_data(bounds));
+    string_delete(bounds);
+  }
+
+  if (where) {
+    string_append(sql, " AND (");
+    string_append(sql, where);
+    string_append(sql, ")");
+  }
+
+  if (order_by) {
+    string_append(sql, " ORDER BY ");
+    string_append(sql, order_by);
+  }
+
+  if (limit) {
+    string_append(sql, " LIMIT ");
+    string_append(sql, limit);
+  }
+
+  db_cursor cursor = used > 0 ? db_query_sql(db, string_get_data(sql)) : NULL;
+  string_delete(sql);
+  return cursor;
+}
+
+static int drop_part(sqlite3 *db, struct partition_t *p, size_t idx) {
+  int64_t key = p->parts[idx].key;
+  if (!p->dir) {
+    string name = partition_name(p, key);
+    string sql = string_printf("DROP TABLE IF EXISTS %s",
+                               string_get_data(name));
+    int rc = busy_exec(db, string_get_data(sql), NULL);
+    if (rc != SQLITE_OK)
+      printf("failed to drop %s: %s\n", string_get_data(name),
+             sqlite3_errmsg(db));
+    string_delete(sql);
+    string_delete(name);
+    return rc;
+  }
+
+  int rc = detach_part(db, p, idx);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  static const char *suffixes[] = {"", "-wal", "-shm", "-journal"};
+  string path = partition_path(p, key);
+  for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+    string file = string_printf("%s%s", string_get_data(path), suffixes[i]);
+    unlink(string_get_data(file));
+    string_delete(file);
+  }
+
+  string_delete(path);
+  return SQLITE_OK;
+}
+
+int db_partition_drop_before(sqlite3 *db, const char *table, int64_t ts,
+                             int *dropped) {
+  if (dropped)
+    *dropped = 0;
+  struct partition_t *p = find_partition(db, table);
+  if (!p)
+    return SQLITE_MISUSE;
+
+  int64_t cut = partition_key(p->unit, ts);
+  int rc = SQLITE_OK;
+  pthread_mutex_lock(&p->lock);
+  while (p->count > 0 && p->parts[0].key < cut) {
+    rc = drop_part(db, p, 0);
+    if (rc != SQLITE_OK)
+      break;
+
+    remove_part(p, 0);
+    if (dropped)
+      (*dropped)++;
+  }
+
+  pthread_mutex_unlock(&p->lock);
+  return rc;
+}
+
+void partition_release(connection_t *conn) {
+  struct partition_t *p = conn->partitions;
+  while (p) {
+    struct partition_t *next = p->next;
+    __atomic_fetch_sub(&g_partition_count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_destroy(&p->lock);
+    db_free(p->parts);
+    db_free(p->table);
+    db_free(p->ts_column);
+    db_free(p->columns_sql);
+    db_free(p->dir);
+    db_free(p);
+    p = next;
+  }
+
+  conn->partitions = NULL;
+}
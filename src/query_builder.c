@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "allocator.h"
+
 static const size_t DEFAULT_STRING_SIZE = 15;
 
 struct string_t {
@@ -27,7 +29,7 @@ static void append_clause(string str, const char *name,
 
 static char *reserve(size_t n) {
   char *data = NULL;
-  data = (char *) malloc(n + 1);
+  data = (char *) db_tag(db_malloc(n + 1), MEM_STRING);
   memset(data, 0, n + 1);
   return data;
 }
@@ -35,7 +37,7 @@ static char *reserve(size_t n) {
 static char *copy_of(string str, size_t size) {
   char *data = reserve(size);
   memcpy(data, str->data, str->size);
-  free(str->data);
+  db_free(str->data);
   return data;
 }
 
@@ -51,7 +53,8 @@ static void expand_capacity(string str, size_t capacity) {
 }
 
 static string string_constructor(size_t n) {
-  string str = (string) malloc(sizeof(struct string_t));
+  string str = (string) db_tag(db_pool_alloc(sizeof(struct string_t)),
+                                MEM_STRING);
   if (n > 0) {
     str->data = reserve(n);
     str->capacity = n;
@@ -65,7 +68,7 @@ static string string_constructor(size_t n) {
 string string_printf(const char *fmt, ...) {
   char *buffer = NULL;
   int size = 512;
-  if ((buffer = calloc(1, size)) == NULL) {
+  if ((buffer = db_calloc(1, size)) == NULL) {
     printf("malloc failed");
     return NULL;
   }
@@ -78,12 +81,12 @@ string string_printf(const char *fmt, ...) {
   if (size > nsize) {
     string str = string_new_with_size(nsize);
     string_append(str, buffer);
-    free(buffer);
+    db_free(buffer);
     return str;
   } else {
-    free(buffer);
+    db_free(buffer);
     char *big_buffer = NULL;
-    if ((big_buffer = calloc(1, nsize + 1)) == NULL) {
+    if ((big_buffer = db_calloc(1, nsize + 1)) == NULL) {
       printf("malloc failed");
       return NULL;
     }
@@ -94,7 +97,7 @@ string string_printf(const char *fmt, ...) {
 
     string str = string_new_with_size(nsize);
     string_append(str, big_buffer);
-    free(big_buffer);
+    db_free(big_buffer);
     return str;
   }
 
@@ -133,11 +136,11 @@ void string_delete(string str) {
   }
 
   if (str->data != NULL) {
-    free(str->data);
+    db_free(str->data);
     str->data = NULL;
   }
 
-  free(str);
+  db_pool_free(str);
   str = NULL;
 }
 
@@ -0,0 +1,250 @@
+#include "scope.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "connection.h"
+#include "query_builder.h"
+
+typedef enum level_action {
+  LEVEL_NONE = 0,           /* Nested in a transaction it did not open */
+  LEVEL_TRANSACTION,        /* Opened with BEGIN */
+  LEVEL_SAVEPOINT           /* Opened with SAVEPOINT db_scope_<depth> */
+} level_action;
+
+typedef struct level_t {
+  bool write;
+  level_action action;
+} level_t;
+
+struct scope_t {
+  pthread_mutex_t lock;     /* Recursive, held from a begin to its end */
+  level_t *levels;
+  int depth;
+  int capacity;
+};
+
+static struct scope_t *get_scope(sqlite3 *db) {
+  connection_t *conn = connection_get(db);
+  if (!conn)
+    return NULL;
+
+  pthread_mutex_lock(&conn->lock);
+  if (!conn->scope) {
+    conn->scope = (struct scope_t *)
+        db_tag(db_calloc(1, sizeof(struct scope_t)), MEM_CACHE);
+    // The thread inside a scope keeps the lock until its outermost scope
+    // ends. Scopes it opens nest, those of other threads wait for it rather
+    // than interleaving with its levels.
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&conn->scope->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+  }
+
+  struct scope_t *scope = conn->scope;
+  pthread_mutex_unlock(&conn->lock);
+  return scope;
+}
+
+static void push_level(struct scope_t *scope, bool write,
+                       level_action action) {
+  if (scope->depth == scope->capacity) {
+    scope->capacity = scope->capacity ? scope->capacity * 2 : 4;
+    scope->levels = (level_t *) db_tag(
+        db_realloc(scope->levels, scope->capacity * sizeof(level_t)),
+        MEM_CACHE);
+  }
+
+  scope->levels[scope->depth].write = write;
+  scope->levels[scope->depth].action = action;
+  scope->depth++;
+}
+
+static int exec_savepoint(sqlite3 *db, const char *fmt, int depth) {
+  string sql = string_printf(fmt, depth, depth);
+  int rc = busy_exec(db, string_get_data(sql), NULL);
+  string_delete(sql);
+  return rc;
+}
+
+int db_read_begin(sqlite3 *db) {
+  struct scope_t *scope = get_scope(db);
+  if (!scope)
+    return SQLITE_MISUSE;
+
+  pthread_mutex_lock(&scope->lock);
+  int rc = SQLITE_OK;
+  level_action action = LEVEL_NONE;
+  if (sqlite3_get_autocommit(db)) {
+    // BEGIN alone defers the read lock to the first query, reading the
+    // schema cookie takes the snapshot now.
+    rc = busy_exec(db, "BEGIN; PRAGMA schema_version", NULL);
+    if (rc != SQLITE_OK) {
+      printf("failed to begin read scope: %s\n", sqlite3_errmsg(db));
+      if (!sqlite3_get_autocommit(db))
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    }
+
+    action = LEVEL_TRANSACTION;
+  }
+
+  if (rc == SQLITE_OK) {
+    push_level(scope, false, action);
+  } else {
+    pthread_mutex_unlock(&scope->lock);
+  }
+
+  return rc;
+}
+
+// Take the lock to end a scope. Only the thread holding it since the begin
+// gets it without waiting.
+static bool lock_end(struct scope_t *scope) {
+  if (pthread_mutex_trylock(&scope->lock) == 0)
+    return true;
+
+  printf("scope ended on another thread\n");
+  return false;
+}
+
+// Pop the innermost scope if it is of the `write` kind, dropping the hold
+// taken by its begin.
+static bool pop_level(struct scope_t *scope, bool write, level_t *level) {
+  if (scope->depth == 0 || scope->levels[scope->depth - 1].write != write) {
+    printf("no %s scope to end\n", write ? "write" : "read");
+    return false;
+  }
+
+  *level = scope->levels[--scope->depth];
+  pthread_mutex_unlock(&scope->lock);
+  return true;
+}
+
+int db_read_end(sqlite3 *db) {
+  struct scope_t *scope = get_scope(db);
+  if (!scope)
+    return SQLITE_MISUSE;
+
+  if (!lock_end(scope))
+    return SQLITE_MISUSE;
+
+  level_t level;
+  int rc = SQLITE_MISUSE;
+  if (pop_level(scope, false, &level)) {
+    rc = SQLITE_OK;
+    // Statements still running keep the snapshot alive, COMMIT of a read
+    // transaction only fails for them.
+    if (level.action == LEVEL_TRANSACTION) {
+      rc = busy_exec(db, "COMMIT", NULL);
+      if (rc != SQLITE_OK)
+        printf("failed to end read scope: %s\n", sqlite3_errmsg(db));
+    }
+  }
+
+  pthread_mutex_unlock(&scope->lock);
+  return rc;
+}
+
+int db_write_begin(sqlite3 *db) {
+  struct scope_t *scope = get_scope(db);
+  if (!scope)
+    return SQLITE_MISUSE;
+
+  pthread_mutex_lock(&scope->lock);
+  int rc;
+  level_action action;
+  if (sqlite3_get_autocommit(db)) {
+    // Take the write lock up front: a deferred transaction that has to
+    // upgrade later can fail with SQLITE_BUSY without waiting.
+    rc = busy_exec(db, "BEGIN IMMEDIATE", NULL);
+    action = LEVEL_TRANSACTION;
+  } else {
+    rc = exec_savepoint(db, "SAVEPOINT db_scope_%d", scope->depth);
+    action = LEVEL_SAVEPOINT;
+  }
+
+  if (rc == SQLITE_OK) {
+    push_level(scope, true, action);
+  } else {
+    printf("failed to begin write scope: %s\n", sqlite3_errmsg(db));
+    pthread_mutex_unlock(&scope->lock);
+  }
+
+  return rc;
+}
+
+static int rollback_level(sqlite3 *db, int depth, level_action action) {
+  switch (action) {
+    case LEVEL_TRANSACTION:
+      return sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    case LEVEL_SAVEPOINT:
+      return exec_savepoint(db, "ROLLBACK TO db_scope_%d; "
+                                "RELEASE db_scope_%d", depth);
+    default:return SQLITE_OK;
+  }
+}
+
+int db_write_commit(sqlite3 *db) {
+  struct scope_t *scope = get_scope(db);
+  if (!scope)
+    return SQLITE_MISUSE;
+
+  if (!lock_end(scope))
+    return SQLITE_MISUSE;
+
+  level_t level;
+  int rc = SQLITE_MISUSE;
+  if (pop_level(scope, true, &level)) {
+    rc = level.action == LEVEL_TRANSACTION
+         ? busy_exec(db, "COMMIT", NULL)
+         : exec_savepoint(db, "RELEASE db_scope_%d", scope->depth);
+    if (rc != SQLITE_OK) {
+      printf("failed to commit write scope: %s\n", sqlite3_errmsg(db));
+      rollback_level(db, scope->depth, level.action);
+    }
+  }
+
+  pthread_mutex_unlock(&scope->lock);
+  return rc;
+}
+
+int db_write_rollback(sqlite3 *db) {
+  struct scope_t *scope = get_scope(db);
+  if (!scope)
+    return SQLITE_MISUSE;
+
+  if (!lock_end(scope))
+    return SQLITE_MISUSE;
+
+  level_t level;
+  int rc = SQLITE_MISUSE;
+  if (pop_level(scope, true, &level))
+    rc = rollback_level(db, scope->depth, level.action);
+  pthread_mutex_unlock(&scope->lock);
+  return rc;
+}
+
+void scope_enter(sqlite3 *db) {
+  struct scope_t *scope = get_scope(db);
+  if (scope)
+    pthread_mutex_lock(&scope->lock);
+}
+
+void scope_leave(sqlite3 *db) {
+  struct scope_t *scope = get_scope(db);
+  if (scope)
+    pthread_mutex_unlock(&scope->lock);
+}
+
+void scope_release(connection_t *conn) {
+  // sqlite3_close rolls back a transaction left open.
+  if (!conn->scope)
+    return;
+
+  pthread_mutex_destroy(&conn->scope->lock);
+  db_free(conn->scope->levels);
+  db_free(conn->scope);
+  conn->scope = NULL;
+}
@@ -0,0 +1,266 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "connection.h"
+#include "query_builder.h"
+
+static const int DEFAULT_PAGES_PER_STEP = 64;
+static const int DEFAULT_STEP_SLEEP_MS = 1;
+// Longest time a copy keeps retrying a locked source or destination without
+// making progress, `copy_lock` is held meanwhile.
+static const int MAX_BUSY_WAIT_MS = 5000;
+
+struct snapshot_t {
+  sqlite3 *db;             /* In-memory source */
+  sqlite3 *file;           /* Destination, only used under `copy_lock` */
+  int pages_per_step;
+  int step_sleep_ms;
+  int interval_ms;
+
+  pthread_mutex_t copy_lock;  /* Serializes snapshots */
+  pthread_mutex_t lock;       /* Guards the fields below */
+  pthread_cond_t wakeup;
+  pthread_t thread;
+  bool running;
+  bool stop;
+
+  int64_t snapshots;
+  int64_t failures;
+  int64_t last_duration_ms;
+  int64_t max_duration_ms;
+  int64_t last_pages;
+  int64_t last_done_ms;
+};
+
+static int64_t get_time_in_ms() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t) (now.tv_sec * 1000 + now.tv_usec / 1000);
+}
+
+static int copy_database(sqlite3 *dest, sqlite3 *src, int pages_per_step,
+                         int step_sleep_ms, int64_t *pages) {
+  sqlite3_backup *backup = sqlite3_backup_init(dest, "main", src, "main");
+  if (!backup) {
+    printf("failed to start backup: %s\n", sqlite3_errmsg(dest));
+    return sqlite3_errcode(dest);
+  }
+
+  int rc;
+  int64_t busy_since = 0;
+  do {
+    rc = sqlite3_backup_step(backup, pages_per_step);
+    // The source connection is only locked while a step runs, so sleeping
+    // in between lets readers and writers through.
+    if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+      int64_t now = get_time_in_ms();
+      if (busy_since == 0) {
+        busy_since = now;
+      } else if (now - busy_since >= MAX_BUSY_WAIT_MS) {
+        printf("backup still locked after %d ms, giving up\n",
+               MAX_BUSY_WAIT_MS);
+        rc = SQLITE_BUSY;
+        break;
+      }
+
+      usleep((step_sleep_ms > 0 ? step_sleep_ms : 1) * 1000);
+    } else if (rc == SQLITE_OK) {
+      busy_since = 0;
+      if (step_sleep_ms > 0)
+        usleep(step_sleep_ms * 1000);
+    }
+  } while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+
+  if (pages)
+    *pages = sqlite3_backup_pagecount(backup);
+  sqlite3_backup_finish(backup);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int take_snapshot(struct snapshot_t *snapshot) {
+  pthread_mutex_lock(&snapshot->copy_lock);
+  int64_t start = get_time_in_ms();
+  int64_t pages = 0;
+  int rc = copy_database(snapshot->file, snapshot->db,
+                         snapshot->pages_per_step, snapshot->step_sleep_ms,
+                         &pages);
+  int64_t end = get_time_in_ms();
+  pthread_mutex_unlock(&snapshot->copy_lock);
+
+  pthread_mutex_lock(&snapshot->lock);
+  if (rc == SQLITE_OK) {
+    snapshot->snapshots++;
+    snapshot->last_duration_ms = end - start;
+    if (snapshot->last_duration_ms > snapshot->max_duration_ms)
+      snapshot->max_duration_ms = snapshot->last_duration_ms;
+    snapshot->last_pages = pages;
+    snapshot->last_done_ms = end;
+  } else {
+    snapshot->failures++;
+    printf("snapshot failed(%d): %s\n", rc, sqlite3_errmsg(snapshot->file));
+  }
+
+  pthread_mutex_unlock(&snapshot->lock);
+  return rc;
+}
+
+static void *snapshot_loop(void *arg) {
+  struct snapshot_t *snapshot = (struct snapshot_t *) arg;
+  pthread_mutex_lock(&snapshot->lock);
+  while (!snapshot->stop) {
+    struct timespec deadline;
+    int64_t wake_ms = get_time_in_ms() + snapshot->interval_ms;
+    deadline.tv_sec = wake_ms / 1000;
+    deadline.tv_nsec = (wake_ms % 1000) * 1000000;
+    int rc = 0;
+    while (!snapshot->stop && rc != ETIMEDOUT) {
+      rc = pthread_cond_timedwait(&snapshot->wakeup, &snapshot->lock,
+                                  &deadline);
+    }
+
+    if (snapshot->stop)
+      break;
+
+    pthread_mutex_unlock(&snapshot->lock);
+    take_snapshot(snapshot);
+    pthread_mutex_lock(&snapshot->lock);
+  }
+
+  pthread_mutex_unlock(&snapshot->lock);
+  return NULL;
+}
+
+sqlite3 *db_init_in_memory(const char *db_path,
+                           const db_snapshot_options *options) {
+  sqlite3 *file = NULL;
+  int rc = sqlite3_open_v2(db_path, &file,
+                           SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  if (rc != SQLITE_OK) {
+    printf("failed to open %s: %s\n", db_path, sqlite3_errmsg(file));
+    sqlite3_close(file);
+    return NULL;
+  }
+
+  sqlite3 *db = NULL;
+  if (options && options->memdb_name) {
+    string uri = string_printf("file:/%s?vfs=memdb", options->memdb_name);
+    rc = sqlite3_open_v2(string_get_data(uri), &db,
+                         SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                         SQLITE_OPEN_URI, NULL);
+    string_delete(uri);
+  } else {
+    rc = sqlite3_open(":memory:", &db);
+  }
+
+  if (rc != SQLITE_OK) {
+    printf("failed to open memory DB: %s\n", sqlite3_errmsg(db));
+    sqlite3_close(db);
+    sqlite3_close(file);
+    return NULL;
+  }
+
+  // Load everything in one go, nobody else can see the database yet.
+  rc = copy_database(db, file, -1, 0, NULL);
+  if (rc != SQLITE_OK) {
+    printf("failed to load %s into memory(%d)\n", db_path, rc);
+    sqlite3_close(db);
+    sqlite3_close(file);
+    return NULL;
+  }
+
+  struct snapshot_t *snapshot =
+      (struct snapshot_t *) db_calloc(1, sizeof(struct snapshot_t));
+  snapshot->db = db;
+  snapshot->file = file;
+  snapshot->pages_per_step = DEFAULT_PAGES_PER_STEP;
+  snapshot->step_sleep_ms = DEFAULT_STEP_SLEEP_MS;
+  if (options) {
+    if (options->pages_per_step > 0)
+      snapshot->pages_per_step = options->pages_per_step;
+    if (options->step_sleep_ms != 0)
+      snapshot->step_sleep_ms = options->step_sleep_ms < 0
+                                ? 0 : options->step_sleep_ms;
+    snapshot->interval_ms = options->interval_ms;
+  }
+
+  snapshot->last_done_ms = get_time_in_ms();
+  pthread_mutex_init(&snapshot->copy_lock, NULL);
+  pthread_mutex_init(&snapshot->lock, NULL);
+  pthread_cond_init(&snapshot->wakeup, NULL);
+  if (snapshot->interval_ms > 0) {
+    snapshot->running =
+        pthread_create(&snapshot->thread, NULL, snapshot_loop, snapshot) == 0;
+    if (!snapshot->running)
+      printf("failed to start snapshot thread\n");
+  }
+
+  connection_setup(db);
+  connection_t *conn = connection_get(db);
+  pthread_mutex_lock(&conn->lock);
+  conn->snapshot = snapshot;
+  pthread_mutex_unlock(&conn->lock);
+  return db;
+}
+
+static struct snapshot_t *find_snapshot(sqlite3 *db) {
+  connection_t *conn = connection_find(db);
+  if (!conn)
+    return NULL;
+
+  pthread_mutex_lock(&conn->lock);
+  struct snapshot_t *snapshot = conn->snapshot;
+  pthread_mutex_unlock(&conn->lock);
+  return snapshot;
+}
+
+int db_snapshot_now(sqlite3 *db) {
+  struct snapshot_t *snapshot = find_snapshot(db);
+  if (!snapshot)
+    return SQLITE_MISUSE;
+
+  return take_snapshot(snapshot);
+}
+
+bool db_snapshot_get_stats(sqlite3 *db, db_snapshot_stats *stats) {
+  struct snapshot_t *snapshot = find_snapshot(db);
+  if (!snapshot || !stats)
+    return false;
+
+  pthread_mutex_lock(&snapshot->lock);
+  stats->snapshots = snapshot->snapshots;
+  stats->failures = snapshot->failures;
+  stats->last_duration_ms = snapshot->last_duration_ms;
+  stats->max_duration_ms = snapshot->max_duration_ms;
+  stats->last_pages = snapshot->last_pages;
+  stats->lag_ms = get_time_in_ms() - snapshot->last_done_ms;
+  pthread_mutex_unlock(&snapshot->lock);
+  return true;
+}
+
+void snapshot_release(struct snapshot_t *snapshot) {
+  if (!snapshot)
+    return;
+
+  if (snapshot->running) {
+    pthread_mutex_lock(&snapshot->lock);
+    snapshot->stop = true;
+    pthread_cond_signal(&snapshot->wakeup);
+    pthread_mutex_unlock(&snapshot->lock);
+    pthread_join(snapshot->thread, NULL);
+  }
+
+  // Nothing written after the last scheduled snapshot may be lost.
+  take_snapshot(snapshot);
+  sqlite3_close(snapshot->file);
+  pthread_cond_destroy(&snapshot->wakeup);
+  pthread_mutex_destroy(&snapshot->lock);
+  pthread_mutex_destroy(&snapshot->copy_lock);
+  db_free(snapshot);
+}
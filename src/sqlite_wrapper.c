@@ -4,6 +4,7 @@
 #include <sys/time.h>
 #include <stdbool.h>
 
+#include "connection.h"
 #include "query_builder.h"
 
 static char *g_db_err_msg = NULL;
@@ -17,7 +18,7 @@ static int64_t get_time_in_ms() {
 static int try_exec(sqlite3 *db, const char *sql) {
   printf("exec sql: %s\n", sql);
   int64_t start = get_time_in_ms();
-  int rc = sqlite3_exec(db, sql, NULL, NULL, &g_db_err_msg);
+  int rc = deadline_exec(db, sql, &g_db_err_msg);
   if (rc != SQLITE_OK) {
     printf("SQL error: %s\n", g_db_err_msg);
     sqlite3_free(g_db_err_msg);
@@ -30,8 +31,24 @@ static int try_exec(sqlite3 *db, const char *sql) {
   return rc;
 }
 
-static void bind_arguments(sqlite3_stmt *sqlit_stmt,
-                           db_content content) {
+void bind_bytes(sqlite3 *db, const char *table, const char *column,
+                sqlite3_stmt *stmt, int idx, bool text, const void *data,
+                size_t len) {
+  void *packed = NULL;
+  size_t packed_len = 0;
+  if (compress_value(db, table, column, text, data, len, &packed,
+                     &packed_len)) {
+    sqlite3_bind_blob64(stmt, idx, packed, packed_len, db_free);
+  } else if (text) {
+    sqlite3_bind_text64(stmt, idx, (const char *) data, len, SQLITE_STATIC,
+                        SQLITE_UTF8);
+  } else {
+    sqlite3_bind_blob64(stmt, idx, data, len, SQLITE_STATIC);
+  }
+}
+
+static void bind_arguments(sqlite3 *db, const char *table,
+                           sqlite3_stmt *sqlit_stmt, db_content content) {
   db_content cur;
   int idx = 1;
   for (cur = content; cur != NULL; cur = content_next(cur), idx++) {
@@ -39,10 +56,17 @@ static void bind_arguments(sqlite3_stmt *sqlit_stmt,
     db_value value = content_get_value(cur, key);
     value_type type = content_get_type(value);
     switch (type) {
-      case VALUE_TEXT:
-        sqlite3_bind_text(sqlit_stmt, idx, content_get_text(value),
-                          -1, SQLITE_STATIC);
+      case VALUE_TEXT: {
+        const char *text = content_get_text(value);
+        bind_bytes(db, table, key, sqlit_stmt, idx, true, text,
+                   strlen(text));
+        break;
+      }
+      case VALUE_BLOB: {
+        bind_bytes(db, table, key, sqlit_stmt, idx, false,
+                   content_get_blob(value), content_get_bytes(value));
         break;
+      }
       case VALUE_INT: {
         sqlite3_bind_int(sqlit_stmt, idx, content_get_int(value));
         break;
@@ -62,11 +86,18 @@ static void bind_arguments(sqlite3_stmt *sqlit_stmt,
   }
 }
 
-static sqlite3_stmt *try_step(sqlite3 *db, const char *sql) {
+static sqlite3_stmt *try_step(sqlite3 *db, const char *sql,
+                              step_deadline_t *budget) {
   printf("try step sql: %s\n", sql);
   sqlite3_stmt *stmt = NULL;
-  sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL);
-  int rc = sqlite3_step(stmt);
+  int rc = sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    printf("failed to prepare sql: %s, error(%d): %s\n",
+           sql, rc, sqlite3_errmsg(db));
+    return NULL;
+  }
+
+  rc = deadline_step(db, stmt, budget);
   if (rc != SQLITE_ROW) {
     sqlite3_finalize(stmt);
     if (rc == SQLITE_DONE) {
@@ -82,24 +113,41 @@ static sqlite3_stmt *try_step(sqlite3 *db, const char *sql) {
   return stmt;
 }
 
-static int try_single_step(sqlite3 *db, const char *sql,
+static int try_single_step(sqlite3 *db, const char *table, const char *sql,
                            db_content args) {
   sqlite3_stmt *stmt = NULL;
-  sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL);
+  int rc = sqlite3_prepare_v2(db, sql, strlen(sql), &stmt, NULL);
   printf("try single step sql: %s\n", sql);
+  if (rc != SQLITE_OK) {
+    printf("failed to prepare sql, error(%d): %s\n", rc, sqlite3_errmsg(db));
+    return rc;
+  }
+
   if (args)
-    bind_arguments(stmt, args);
+    bind_arguments(db, table, stmt, args);
 
-  int rc = sqlite3_step(stmt);
+  step_deadline_t budget = {NULL, 0};
+  rc = deadline_step(db, stmt, &budget);
   // Suppose used for UPDATA, INSTER, so no row return.
   if (rc != SQLITE_DONE) {
     printf("insert error(%d): %s\n", rc, sqlite3_errmsg(db));
   }
 
+  diagnostics_observe(db, stmt);
   sqlite3_finalize(stmt);
   return rc != SQLITE_DONE ? rc : SQLITE_OK;
 }
 
+static db_cursor new_cursor(sqlite3 *db, sqlite3_stmt *stmt,
+                            step_deadline_t budget) {
+  if (!stmt)
+    return NULL;
+
+  db_cursor cursor = cursor_new(db, stmt);
+  cursor_set_deadline(cursor, budget);
+  return cursor;
+}
+
 static void callback(void *udp, int type,
                      const char *db_name, const char *tbl_name, sqlite3_int64 rowid) {
   printf("db_name: %s, tbl_name: %s, type: %d, rowid: %lld\n",
@@ -123,9 +171,10 @@ db_cursor db_query(sqlite3 *db, const char *table,
                    const char *limit) {
   string sql = build_query_string(false, table, columns,
                                   where, group_by, having, order_by, limit);
-  sqlite3_stmt *stmt = try_step(db, string_get_data(sql));
+  step_deadline_t budget = {NULL, 0};
+  sqlite3_stmt *stmt = try_step(db, string_get_data(sql), &budget);
   string_delete(sql);
-  return stmt ? cursor_new(db, stmt) : NULL;
+  return new_cursor(db, stmt, budget);
 }
 
 int db_update(sqlite3 *db, const char *table, db_content content,
@@ -133,7 +182,9 @@ int db_update(sqlite3 *db, const char *table, db_content content,
   printf("update start =>\n");
   int64_t start = get_time_in_ms();
   string sql = buildUpdate(table, content, where);
-  int rc = try_single_step(db, string_get_data(sql), content);
+  scope_enter(db);
+  int rc = try_single_step(db, table, string_get_data(sql), content);
+  scope_leave(db);
   string_delete(sql);
   printf("=> update end (%lld ms)\n", get_time_in_ms() - start);
   return rc;
@@ -142,9 +193,21 @@ int db_update(sqlite3 *db, const char *table, db_content content,
 int db_insert(sqlite3 *db, const char *table, db_content content) {
   printf("insert start =>\n");
   int64_t start = get_time_in_ms();
-  string sql = buildInsert(table, content);
-  int rc = try_single_step(db, string_get_data(sql), content);
+  string target = NULL;
+  scope_enter(db);
+  int rc = partition_route(db, table, content, &target);
+  if (rc != SQLITE_OK) {
+    scope_leave(db);
+    return rc;
+  }
+
+  string sql = buildInsert(target ? string_get_data(target) : table, content);
+  // Compression rules stay keyed by the logical table.
+  rc = try_single_step(db, table, string_get_data(sql), content);
+  scope_leave(db);
   string_delete(sql);
+  if (target)
+    string_delete(target);
   printf("=> insert end (%lld ms)\n", get_time_in_ms() - start);
   return rc;
 }
@@ -157,7 +220,9 @@ int db_delete(sqlite3 *db, const char *table, const char *where) {
   string_append(sql, table);
   string_append(sql, " WHERE ");
   string_append(sql, where);
+  scope_enter(db);
   int rc = try_exec(db, string_get_data(sql));
+  scope_leave(db);
   string_delete(sql);
   printf("=> delete end (%lld ms)\n", get_time_in_ms() - start);
   return rc;
@@ -172,10 +237,12 @@ sqlite3 *db_init(const char *db_name) {
     return NULL;
   }
 
+  connection_setup(db);
   return db;
 }
 
 void db_deinit(sqlite3 *db) {
+  connection_release(db);
   sqlite3_close(db);
 }
 
@@ -184,8 +251,9 @@ int db_exec_sql(sqlite3 *db, const char *sql) {
 }
 
 db_cursor db_query_sql(sqlite3 *db, const char *sql) {
-  sqlite3_stmt *stmt = try_step(db, sql);
-  return stmt ? cursor_new(db, stmt) : NULL;
+  step_deadline_t budget = {NULL, 0};
+  sqlite3_stmt *stmt = try_step(db, sql, &budget);
+  return new_cursor(db, stmt, budget);
 }
 
 bool db_column_exists(sqlite3 *db, const char *table, const char *column) {
@@ -0,0 +1,138 @@
+#include "statement.h"
+
+#include <stdio.h>
+
+#include "allocator.h"
+#include "connection.h"
+
+struct stmt_t {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  step_deadline_t budget;
+};
+
+db_stmt db_prepare(sqlite3 *db, const char *sql) {
+  sqlite3_stmt *handle = NULL;
+  int rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT,
+                              &handle, NULL);
+  if (rc != SQLITE_OK) {
+    printf("failed to prepare sql: %s, error(%d): %s\n",
+           sql, rc, sqlite3_errmsg(db));
+    sqlite3_finalize(handle);
+    return NULL;
+  }
+
+  db_stmt stmt = (db_stmt) db_malloc(sizeof(struct stmt_t));
+  stmt->db = db;
+  stmt->stmt = handle;
+  stmt->budget.deadline = NULL;
+  stmt->budget.expires_ms = 0;
+  return stmt;
+}
+
+void db_stmt_finalize(db_stmt stmt) {
+  if (!stmt)
+    return;
+
+  diagnostics_observe(stmt->db, stmt->stmt);
+  sqlite3_finalize(stmt->stmt);
+  db_free(stmt);
+}
+
+int db_stmt_bind_null(db_stmt stmt, int idx) {
+  return sqlite3_bind_null(stmt->stmt, idx);
+}
+
+int db_stmt_bind_int(db_stmt stmt, int idx, int i) {
+  return sqlite3_bind_int(stmt->stmt, idx, i);
+}
+
+int db_stmt_bind_int64(db_stmt stmt, int idx, int64_t i) {
+  return sqlite3_bind_int64(stmt->stmt, idx, i);
+}
+
+int db_stmt_bind_double(db_stmt stmt, int idx, double d) {
+  return sqlite3_bind_double(stmt->stmt, idx, d);
+}
+
+int db_stmt_bind_text(db_stmt stmt, int idx, const char *s, int len) {
+  if (!s)
+    return sqlite3_bind_null(stmt->stmt, idx);
+
+  return sqlite3_bind_text(stmt->stmt, idx, s, len, SQLITE_STATIC);
+}
+
+int db_stmt_bind_blob(db_stmt stmt, int idx, const void *data, int len) {
+  if (!data)
+    return sqlite3_bind_null(stmt->stmt, idx);
+
+  return sqlite3_bind_blob(stmt->stmt, idx, data, len, SQLITE_STATIC);
+}
+
+static int parameter_index(db_stmt stmt, const char *name) {
+  int idx = sqlite3_bind_parameter_index(stmt->stmt, name);
+  if (idx == 0) {
+    printf("no such parameter: %s\n", name);
+  }
+
+  return idx;
+}
+
+int db_stmt_bind_null_by_name(db_stmt stmt, const char *name) {
+  int idx = parameter_index(stmt, name);
+  return idx ? db_stmt_bind_null(stmt, idx) : SQLITE_RANGE;
+}
+
+int db_stmt_bind_int_by_name(db_stmt stmt, const char *name, int i) {
+  int idx = parameter_index(stmt, name);
+  return idx ? db_stmt_bind_int(stmt, idx, i) : SQLITE_RANGE;
+}
+
+int db_stmt_bind_int64_by_name(db_stmt stmt, const char *name, int64_t i) {
+  int idx = parameter_index(stmt, name);
+  return idx ? db_stmt_bind_int64(stmt, idx, i) : SQLITE_RANGE;
+}
+
+int db_stmt_bind_double_by_name(db_stmt stmt, const char *name, double d) {
+  int idx = parameter_index(stmt, name);
+  return idx ? db_stmt_bind_double(stmt, idx, d) : SQLITE_RANGE;
+}
+
+int db_stmt_bind_text_by_name(db_stmt stmt, const char *name,
+                              const char *s, int len) {
+  int idx = parameter_index(stmt, name);
+  return idx ? db_stmt_bind_text(stmt, idx, s, len) : SQLITE_RANGE;
+}
+
+int db_stmt_bind_blob_by_name(db_stmt stmt, const char *name,
+                              const void *data, int len) {
+  int idx = parameter_index(stmt, name);
+  return idx ? db_stmt_bind_blob(stmt, idx, data, len) : SQLITE_RANGE;
+}
+
+int db_stmt_step(db_stmt stmt) {
+  int rc = deadline_step(stmt->db, stmt->stmt, &stmt->budget);
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    printf("step error(%d): %s\n", rc, sqlite3_errmsg(stmt->db));
+  }
+
+  return rc;
+}
+
+int db_stmt_reset(db_stmt stmt) {
+  // sqlite3_reset repeats the error of the last step, which the caller
+  // already got from db_stmt_step.
+  diagnostics_observe(stmt->db, stmt->stmt);
+  sqlite3_reset(stmt->stmt);
+  return sqlite3_clear_bindings(stmt->stmt);
+}
+
+db_cursor db_stmt_cursor(db_stmt stmt) {
+  db_cursor cursor = cursor_new_borrowed(stmt->db, stmt->stmt);
+  cursor_set_deadline(cursor, stmt->budget);
+  return cursor;
+}
+
+sqlite3_stmt *db_stmt_handle(db_stmt stmt) {
+  return stmt->stmt;
+}
@@ -0,0 +1,225 @@
+#include "struct_map.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "connection.h"
+#include "query_builder.h"
+#include "scope.h"
+#include "sqlite_wrapper.h"
+
+struct struct_stmt_t {
+  const db_struct_map *map;
+  sqlite3_stmt *stmt;
+  pthread_mutex_t lock;     /* The statement is shared by every caller */
+  int users;                /* Callers holding the entry, under conn->lock */
+  struct struct_stmt_t *next;
+};
+
+static string build_struct_insert(const db_struct_map *map) {
+  string sql = string_new();
+  string_append(sql, "INSERT INTO ");
+  string_append(sql, map->table);
+  string_append(sql, "(");
+  for (size_t i = 0; i < map->field_count; i++) {
+    if (i > 0) {
+      string_append(sql, ", ");
+    }
+
+    string_append(sql, map->fields[i].name);
+  }
+
+  string_append(sql, ") VALUES (");
+  for (size_t i = 0; i < map->field_count; i++) {
+    if (i > 0) {
+      string_append(sql, ", ");
+    }
+
+    string_append(sql, "?");
+  }
+
+  string_append(sql, ")");
+  return sql;
+}
+
+static struct struct_stmt_t *get_insert_stmt(sqlite3 *db,
+                                             const db_struct_map *map) {
+  connection_t *conn = connection_get(db);
+  pthread_mutex_lock(&conn->lock);
+  struct struct_stmt_t *cur = conn->struct_stmts;
+  while (cur && cur->map != map) {
+    cur = cur->next;
+  }
+
+  if (!cur) {
+    string sql = build_struct_insert(map);
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v3(db, string_get_data(sql), -1,
+                           SQLITE_PREPARE_PERSISTENT, &stmt,
+                           NULL) == SQLITE_OK) {
+      cur = (struct struct_stmt_t *)
+          db_tag(db_calloc(1, sizeof(struct struct_stmt_t)), MEM_CACHE);
+      cur->map = map;
+      cur->stmt = stmt;
+      pthread_mutex_init(&cur->lock, NULL);
+      cur->next = conn->struct_stmts;
+      conn->struct_stmts = cur;
+    } else {
+      printf("failed to prepare %s: %s\n",
+             string_get_data(sql), sqlite3_errmsg(db));
+    }
+
+    string_delete(sql);
+  }
+
+  if (cur)
+    cur->users++;
+  pthread_mutex_unlock(&conn->lock);
+  return cur;
+}
+
+static void put_insert_stmt(sqlite3 *db, struct struct_stmt_t *cached) {
+  connection_t *conn = connection_get(db);
+  pthread_mutex_lock(&conn->lock);
+  cached->users--;
+  pthread_mutex_unlock(&conn->lock);
+}
+
+static void bind_struct(sqlite3 *db, sqlite3_stmt *stmt,
+                        const db_struct_map *map, const char *row) {
+  for (size_t i = 0; i < map->field_count; i++) {
+    const db_field *field = &map->fields[i];
+    const char *member = row + field->offset;
+    int idx = (int) i + 1;
+    switch (field->type) {
+      case FIELD_INT:sqlite3_bind_int(stmt, idx, *(const int *) member);
+        break;
+      case FIELD_INT64:
+        sqlite3_bind_int64(stmt, idx, *(const int64_t *) member);
+        break;
+      case FIELD_DOUBLE:
+        sqlite3_bind_double(stmt, idx, *(const double *) member);
+        break;
+      case FIELD_TEXT: {
+        const char *text = *(const char *const *) member;
+        if (text) {
+          bind_bytes(db, map->table, field->name, stmt, idx, true, text,
+                     strlen(text));
+        } else {
+          sqlite3_bind_null(stmt, idx);
+        }
+        break;
+      }
+      case FIELD_CHARS:
+        bind_bytes(db, map->table, field->name, stmt, idx, true, member,
+                   strnlen(member, field->size));
+        break;
+      default:printf("Not support field type: %d\n", field->type);
+        sqlite3_bind_null(stmt, idx);
+    }
+  }
+}
+
+static int insert_rows(sqlite3 *db, const db_struct_map *map,
+                       const char *rows, size_t count, size_t stride) {
+  // The cached statement names the table itself, it cannot follow rows to
+  // their partition.
+  if (partitioned(db, map->table)) {
+    printf("struct insert into partitioned table %s\n", map->table);
+    return SQLITE_MISUSE;
+  }
+
+  struct struct_stmt_t *cached = get_insert_stmt(db, map);
+  if (!cached)
+    return sqlite3_errcode(db);
+
+  int rc = SQLITE_OK;
+  pthread_mutex_lock(&cached->lock);
+  for (size_t i = 0; i < count; i++) {
+    bind_struct(db, cached->stmt, map, rows + i * stride);
+    step_deadline_t budget = {NULL, 0};
+    rc = deadline_step(db, cached->stmt, &budget);
+    diagnostics_observe(db, cached->stmt);
+    sqlite3_reset(cached->stmt);
+    if (rc != SQLITE_DONE) {
+      printf("insert error(%d): %s\n", rc, sqlite3_errmsg(db));
+      break;
+    }
+
+    rc = SQLITE_OK;
+  }
+
+  // Text fields may be bound SQLITE_STATIC, do not keep pointers to them.
+  sqlite3_clear_bindings(cached->stmt);
+  pthread_mutex_unlock(&cached->lock);
+  put_insert_stmt(db, cached);
+  return rc;
+}
+
+int db_insert_struct(sqlite3 *db, const db_struct_map *map,
+                     const void *row) {
+  scope_enter(db);
+  int rc = insert_rows(db, map, (const char *) row, 1, 0);
+  scope_leave(db);
+  return rc;
+}
+
+int db_insert_structs(sqlite3 *db, const db_struct_map *map,
+                      const void *rows, size_t count, size_t stride) {
+  // A savepoint when the caller already runs a scope or transaction.
+  int rc = db_write_begin(db);
+  if (rc != SQLITE_OK)
+    return rc;
+
+  rc = insert_rows(db, map, (const char *) rows, count, stride);
+  if (rc != SQLITE_OK) {
+    db_write_rollback(db);
+    return rc;
+  }
+
+  return db_write_commit(db);
+}
+
+db_cursor db_query_struct(sqlite3 *db, const db_struct_map *map,
+                          const char *where, const char *order_by,
+                          const char *limit) {
+  db_column columns = columns_new();
+  for (size_t i = 0; i < map->field_count; i++) {
+    columns_push(&columns, map->fields[i].name);
+  }
+
+  db_cursor cursor = db_query(db, map->table, columns, where, NULL, NULL,
+                              order_by, limit);
+  columns_delete(columns);
+  return cursor;
+}
+
+void struct_stmts_trim(connection_t *conn) {
+  pthread_mutex_lock(&conn->lock);
+  struct struct_stmt_t **link = &conn->struct_stmts;
+  while (*link) {
+    struct struct_stmt_t *cur = *link;
+    if (cur->users > 0) {
+      link = &cur->next;
+      continue;
+    }
+
+    *link = cur->next;
+    sqlite3_finalize(cur->stmt);
+    pthread_mutex_destroy(&cur->lock);
+    db_free(cur);
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+}
+
+void struct_stmts_release(struct struct_stmt_t *stmts) {
+  while (stmts) {
+    struct struct_stmt_t *next = stmts->next;
+    sqlite3_finalize(stmts->stmt);
+    pthread_mutex_destroy(&stmts->lock);
+    db_free(stmts);
+    stmts = next;
+  }
+}